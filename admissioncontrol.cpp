@@ -0,0 +1,293 @@
+#include "admissioncontrol.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QStandardPaths>
+#include <QThread>
+
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+
+namespace {
+
+// used for packages that have never been built with admission control
+constexpr quint64 DefaultPeak = 1024ull * 1024ull * 1024ull;
+constexpr int PollInterval = 2000;
+// a build is never paused for longer, and then runs at least as long before it can be paused again
+constexpr qint64 MaxPauseTime = 5 * 60 * 1000;
+
+QByteArray readProcFile(const QString &path)
+{
+	// proc files report a size of 0, so they must be read until the end
+	QFile file{path};
+	if(!file.open(QIODevice::ReadOnly))
+		return {};
+	return file.readAll();
+}
+
+}
+
+AdmissionControl::AdmissionControl(QObject *parent) :
+	QObject{parent},
+	_stats{new QSettings{
+		QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QStringLiteral("/buildstats.conf"),
+		QSettings::IniFormat,
+		this
+	}}
+{}
+
+bool AdmissionControl::isEnabled() const
+{
+	QSettings settings;
+	return settings.childGroups().contains(QStringLiteral("admission"));
+}
+
+QString AdmissionControl::limitsDescription() const
+{
+	const auto limits = readLimits();
+	QStringList parts;
+	if(limits.load > 0)
+		parts.append(QStringLiteral("load=%1").arg(limits.load));
+	if(limits.memory > 0)
+		parts.append(QStringLiteral("memory=%1").arg(limits.memory));
+	if(limits.pressure > 0)
+		parts.append(QStringLiteral("pressure=%1").arg(limits.pressure));
+	return parts.join(QLatin1Char(','));
+}
+
+void AdmissionControl::setLimits(const QString &limits)
+{
+	QSettings settings;
+	settings.remove(QStringLiteral("admission"));
+	if(limits.isEmpty()) {
+		qDebug() << "Disabled build admission control";
+		return;
+	}
+
+	for(const auto &limit : limits.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+		const auto parts = limit.split(QLatin1Char('='));
+		auto ok = parts.size() == 2;
+		if(ok) {
+			const auto key = parts[0].trimmed();
+			if(key == QStringLiteral("load") || key == QStringLiteral("pressure"))
+				settings.setValue(QStringLiteral("admission/") + key, parts[1].toDouble(&ok));
+			else if(key == QStringLiteral("memory"))
+				settings.setValue(QStringLiteral("admission/") + key, parts[1].toULongLong(&ok));
+			else
+				ok = false;
+		}
+		if(!ok) {
+			settings.remove(QStringLiteral("admission"));
+			throw QStringLiteral("Invalid limit \"%1\" - must be one of load=<n>, memory=<MiB> or pressure=<percent>").arg(limit);
+		}
+	}
+	// builds are always run with lowered priority, even without any limits
+	if(!settings.childGroups().contains(QStringLiteral("admission")))
+		settings.setValue(QStringLiteral("admission/load"), 0);
+	qDebug() << "Updated build admission limits to" << limitsDescription();
+}
+
+void AdmissionControl::admit(const QStringList &pkgs)
+{
+	const auto limits = readLimits();
+	const auto peak = estimatePeak(pkgs);
+	auto waiting = false;
+	forever {
+		const auto snapshot = readSnapshot();
+		// never wait for more memory than the machine could possibly provide
+		const auto required = std::min(peak + limits.memory * 1024ull * 1024ull,
+									   snapshot.totalMemory / 10ull * 9ull);
+
+		QString reason;
+		if(limits.load > 0 && snapshot.load > limits.load)
+			reason = QStringLiteral("load average is %1").arg(snapshot.load);
+		else if(limits.pressure > 0 && snapshot.pressure > limits.pressure)
+			reason = QStringLiteral("resource pressure is %1%").arg(snapshot.pressure);
+		else if(snapshot.totalMemory > 0 && snapshot.availableMemory < required) {
+			reason = QStringLiteral("only %1 MiB of %2 MiB memory are available")
+					 .arg(snapshot.availableMemory / 1024ull / 1024ull)
+					 .arg(required / 1024ull / 1024ull);
+		}
+		if(reason.isNull())
+			break;
+
+		if(!waiting) {
+			qInfo().noquote() << "Waiting to build" << pkgs.join(QLatin1Char(' ')) << "-" << reason;
+			waiting = true;
+		}
+		QThread::msleep(PollInterval);
+	}
+}
+
+int AdmissionControl::execute(QProcess &proc, const QStringList &pkgs)
+{
+	// run the builds with the lowest priorities, so they only use otherwise idle resources
+	QStringList args;
+	const auto ionice = QStandardPaths::findExecutable(QStringLiteral("ionice"));
+	if(!ionice.isNull())
+		args << ionice << QStringLiteral("-c") << QStringLiteral("3");
+	const auto nice = QStandardPaths::findExecutable(QStringLiteral("nice"));
+	if(!nice.isNull())
+		args << nice << QStringLiteral("-n") << QStringLiteral("19");
+	if(!args.isEmpty()) {
+		args << proc.program() << proc.arguments();
+		proc.setProgram(args.takeFirst());
+		proc.setArguments(args);
+	}
+
+	const auto limits = readLimits();
+	quint64 peak = 0;
+	auto canPause = limits.pressure > 0;
+	auto paused = false;
+	auto forcedContinue = false;
+	QElapsedTimer pauseTimer;
+	proc.start();
+	if(!proc.waitForStarted(-1))
+		return -2;
+	while(!proc.waitForFinished(PollInterval)) {
+		const auto tree = processTree(static_cast<pid_t>(proc.processId()));
+		peak = std::max(peak, readTreeMemory(tree));
+		if(!canPause)
+			continue;
+
+		// pause the whole build while the machine is under pressure, continue once it calmed down.
+		// Available memory is only checked before a build starts, as a stopped build keeps all of it's memory
+		const auto pressure = readSnapshot().pressure;
+		if(!paused) {
+			if(pressure > limits.pressure && (!forcedContinue || pauseTimer.hasExpired(MaxPauseTime))) {
+				qInfo() << "Pausing build because of high resource pressure";
+				if(signalTree(tree, SIGSTOP)) {
+					paused = true;
+					pauseTimer.start();
+				} else {
+					// parts of the build running as a different user (e.g. via sudo) cannot be stopped
+					qWarning() << "Unable to pause the build, continuing without pausing it";
+					signalTree(tree, SIGCONT);
+					canPause = false;
+				}
+			}
+		} else if(pressure <= limits.pressure / 2 || pauseTimer.hasExpired(MaxPauseTime)) {
+			forcedContinue = pressure > limits.pressure / 2;
+			if(forcedContinue)
+				qInfo() << "Continuing build, it was paused for too long";
+			else
+				qInfo() << "Continuing paused build";
+			if(!signalTree(tree, SIGCONT))
+				qWarning() << "Failed to continue some processes of the paused build";
+			paused = false;
+			pauseTimer.start();
+		}
+	}
+
+	if(proc.exitStatus() != QProcess::NormalExit)
+		return -1;
+	if(peak > 0)
+		recordPeak(pkgs, peak);
+	return proc.exitCode();
+}
+
+AdmissionControl::Limits AdmissionControl::readLimits() const
+{
+	QSettings settings;
+	Limits limits;
+	limits.load = settings.value(QStringLiteral("admission/load"), 0).toDouble();
+	limits.memory = settings.value(QStringLiteral("admission/memory"), 0).toULongLong();
+	limits.pressure = settings.value(QStringLiteral("admission/pressure"), 0).toDouble();
+	return limits;
+}
+
+quint64 AdmissionControl::estimatePeak(const QStringList &pkgs) const
+{
+	// packages of one call are built one after the other, so the largest one counts
+	quint64 peak = 0;
+	for(const auto &pkg : pkgs)
+		peak = std::max(peak, _stats->value(QStringLiteral("peak/") + pkg, DefaultPeak).toULongLong());
+	return peak;
+}
+
+void AdmissionControl::recordPeak(const QStringList &pkgs, quint64 peak)
+{
+	// with multiple packages, the peak belongs to one of them, so only fill in unknown ones
+	for(const auto &pkg : pkgs) {
+		const auto key = QStringLiteral("peak/") + pkg;
+		if(pkgs.size() == 1 || !_stats->contains(key))
+			_stats->setValue(key, peak);
+	}
+	_stats->sync();
+}
+
+AdmissionControl::Snapshot AdmissionControl::readSnapshot()
+{
+	Snapshot snapshot;
+	snapshot.load = readProcFile(QStringLiteral("/proc/loadavg")).split(' ').value(0).toDouble();
+
+	for(const auto &line : readProcFile(QStringLiteral("/proc/meminfo")).split('\n')) {
+		const auto fields = line.simplified().split(' ');
+		if(fields.size() < 2)
+			continue;
+		if(fields[0] == "MemTotal:")
+			snapshot.totalMemory = fields[1].toULongLong() * 1024ull;
+		else if(fields[0] == "MemAvailable:")
+			snapshot.availableMemory = fields[1].toULongLong() * 1024ull;
+	}
+
+	// lines look like: some avg10=1.23 avg60=0.50 avg300=0.12 total=12345
+	for(const auto &resource : {QStringLiteral("cpu"), QStringLiteral("memory"), QStringLiteral("io")}) {
+		for(const auto &line : readProcFile(QStringLiteral("/proc/pressure/") + resource).split('\n')) {
+			if(!line.startsWith("some "))
+				continue;
+			for(const auto &field : line.split(' ')) {
+				if(field.startsWith("avg10="))
+					snapshot.pressure = std::max(snapshot.pressure, field.mid(6).toDouble());
+			}
+		}
+	}
+	return snapshot;
+}
+
+QList<pid_t> AdmissionControl::processTree(pid_t root)
+{
+	// map all processes to their parents, to find everything the build has spawned
+	QMultiHash<pid_t, pid_t> children;
+	for(const auto &entry : QDir{QStringLiteral("/proc")}.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+		auto ok = false;
+		const auto pid = static_cast<pid_t>(entry.toInt(&ok));
+		if(!ok)
+			continue;
+		// the command name may contain spaces, so parse after it's closing bracket
+		const auto stat = readProcFile(QStringLiteral("/proc/%1/stat").arg(entry));
+		const auto fields = stat.mid(stat.lastIndexOf(')') + 2).split(' ');
+		if(fields.size() > 1)
+			children.insert(static_cast<pid_t>(fields[1].toInt()), pid);
+	}
+
+	QList<pid_t> tree{root};
+	for(auto i = 0; i < tree.size(); i++)
+		tree.append(children.values(tree[i]));
+	return tree;
+}
+
+quint64 AdmissionControl::readTreeMemory(const QList<pid_t> &pids)
+{
+	static const auto pageSize = static_cast<quint64>(sysconf(_SC_PAGESIZE));
+	quint64 memory = 0;
+	for(const auto pid : pids)
+		memory += readProcFile(QStringLiteral("/proc/%1/statm").arg(pid)).split(' ').value(1).toULongLong() * pageSize;
+	return memory;
+}
+
+bool AdmissionControl::signalTree(const QList<pid_t> &pids, int signal)
+{
+	// parents first, so they cannot react to stopped children
+	auto ok = true;
+	for(const auto pid : pids) {
+		// processes that exited in the meantime do not matter
+		if(::kill(pid, signal) == -1 && errno != ESRCH)
+			ok = false;
+	}
+	return ok;
+}
@@ -0,0 +1,51 @@
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include <QObject>
+#include <QProcess>
+#include <QSettings>
+
+#include <sys/types.h>
+
+class AdmissionControl : public QObject
+{
+	Q_OBJECT
+
+public:
+	struct Snapshot {
+		double load = 0;
+		quint64 totalMemory = 0;
+		quint64 availableMemory = 0;
+		double pressure = 0;
+	};
+
+	explicit AdmissionControl(QObject *parent = nullptr);
+
+	bool isEnabled() const;
+	QString limitsDescription() const;
+	void setLimits(const QString &limits); // load=<n>,memory=<MiB>,pressure=<percent>
+
+	void admit(const QStringList &pkgs);
+	int execute(QProcess &proc, const QStringList &pkgs);
+
+	static Snapshot readSnapshot();
+
+private:
+	struct Limits {
+		double load = 0; // 1 minute load average, 0 to disable
+		quint64 memory = 0; // MiB that must stay available besides the build
+		double pressure = 0; // percent of some-stall time over 10 seconds, 0 to disable
+	};
+
+	QSettings *_stats;
+
+	Limits readLimits() const;
+	quint64 estimatePeak(const QStringList &pkgs) const;
+	void recordPeak(const QStringList &pkgs, quint64 peak);
+
+	static QList<pid_t> processTree(pid_t root);
+	static quint64 readTreeMemory(const QList<pid_t> &pids);
+	static bool signalTree(const QList<pid_t> &pids, int signal);
+};
+
+#endif // ADMISSIONCONTROL_H
@@ -0,0 +1,390 @@
+#include "buildfarm.h"
+#include "buildprofile.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QProcess>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QSysInfo>
+#include <QThread>
+#include <optional>
+
+#include <cerrno>
+#include <csignal>
+
+namespace {
+
+// claims are refreshed while building, and given back to the queue once their worker is gone
+constexpr int HeartbeatInterval = 30 * 1000;
+constexpr qint64 StaleClaimTimeout = 5 * 60;
+
+}
+
+BuildFarm::BuildFarm(PacmanRunner *runner, PkgResolver *resolver, QObject *parent) :
+	QObject{parent},
+	_runner{runner},
+	_resolver{resolver}
+{}
+
+QList<BuildFarm::Task> BuildFarm::createPlan(int shards) const
+{
+	if(shards < 1)
+		throw QStringLiteral("The number of shards must be at least 1");
+
+	const auto pkgInfos = _resolver->listPkgInfos();
+	const auto waves = _resolver->listPkgWaves();
+
+	// create the tasks with their ordering edges and cost hints
+	QHash<QString, Task> tasks;
+	for(auto i = 0; i < waves.size(); i++) {
+		for(const auto &pkg : waves[i]) {
+			Task task;
+			task.name = pkg;
+			task.triggers = pkgInfos.value(pkg).toList();
+			std::sort(task.triggers.begin(), task.triggers.end());
+			for(const auto &trigger : qAsConst(task.triggers)) {
+				if(pkgInfos.contains(trigger))
+					task.after.append(trigger);
+			}
+			// the installed size is the best estimate for the build cost we have
+			task.cost = std::max<quint64>(_runner->readInstalledSize(pkg), 1);
+			task.wave = i;
+			tasks.insert(pkg, task);
+		}
+	}
+
+	// workers wait for dependencies built on other shards, so only the split packages of a pkgbase are kept together
+	const auto pkgBases = _resolver->readPkgBases(tasks.keys());
+	QHash<QString, int> baseShards;
+	QVector<quint64> loads(shards, 0);
+	for(const auto &wave : waves) {
+		QMap<QString, std::pair<quint64, QStringList>> groups; // pkgbase -> (cost, packages)
+		for(const auto &pkg : wave) {
+			auto &group = groups[pkgBases.value(pkg, pkg)];
+			group.first += tasks[pkg].cost;
+			group.second.append(pkg);
+		}
+		auto sortedGroups = groups.keys();
+		std::stable_sort(sortedGroups.begin(), sortedGroups.end(), [&groups](const QString &lhs, const QString &rhs) {
+			return groups[lhs].first > groups[rhs].first;
+		});
+
+		// balance every wave on it's own, as the next wave can only start once it is done
+		QVector<quint64> waveLoads(shards, 0);
+		for(const auto &pkgBase : qAsConst(sortedGroups)) {
+			const auto &group = groups[pkgBase];
+			auto shard = baseShards.value(pkgBase, -1);
+			if(shard < 0) {
+				shard = 0;
+				for(auto i = 1; i < shards; i++) {
+					if(std::make_pair(waveLoads[i], loads[i]) < std::make_pair(waveLoads[shard], loads[shard]))
+						shard = i;
+				}
+				baseShards.insert(pkgBase, shard);
+			}
+			waveLoads[shard] += group.first;
+			loads[shard] += group.first;
+			for(const auto &pkg : group.second)
+				tasks[pkg].shard = shard;
+		}
+	}
+
+	QList<Task> plan;
+	plan.reserve(tasks.size());
+	for(const auto &wave : waves) {
+		for(const auto &pkg : wave)
+			plan.append(tasks.value(pkg));
+	}
+	return plan;
+}
+
+QJsonDocument BuildFarm::planToJson(const QList<Task> &plan, int shards)
+{
+	QJsonArray packages;
+	QVector<quint64> loads(shards, 0);
+	QVector<QJsonArray> shardPkgs(shards);
+	for(const auto &task : plan) {
+		packages.append(taskToJson(task));
+		loads[task.shard] += task.cost;
+		shardPkgs[task.shard].append(task.name);
+	}
+
+	QJsonArray shardArray;
+	for(auto i = 0; i < shards; i++) {
+		shardArray.append(QJsonObject {
+							  {QStringLiteral("index"), i},
+							  {QStringLiteral("cost"), static_cast<qint64>(loads[i])},
+							  {QStringLiteral("packages"), shardPkgs[i]}
+						  });
+	}
+
+	return QJsonDocument{QJsonObject {
+			{QStringLiteral("shards"), shardArray},
+			{QStringLiteral("packages"), packages}
+		}};
+}
+
+QString BuildFarm::planToText(const QList<Task> &plan, int shards)
+{
+	QStringList lines;
+	for(auto i = 0; i < shards; i++) {
+		quint64 cost = 0;
+		QMap<int, QStringList> waves;
+		for(const auto &task : plan) {
+			if(task.shard != i)
+				continue;
+			cost += task.cost;
+			waves[task.wave].append(task.name);
+		}
+		lines.append(QStringLiteral("Shard %1 (cost: %2)").arg(i).arg(cost));
+		for(const auto &wave : qAsConst(waves))
+			lines.append(QStringLiteral("\t%1").arg(wave.join(QLatin1Char(' '))));
+	}
+	return lines.join(QLatin1Char('\n'));
+}
+
+void BuildFarm::writeSpool(const QString &spoolDir, const QList<Task> &plan, int shards) const
+{
+	const auto queueDir = spoolSubDir(spoolDir, QStringLiteral("queue"));
+	if(!queueDir.entryList(QDir::Files).isEmpty())
+		throw QStringLiteral("The spool directory %1 already contains queued packages").arg(spoolDir);
+	for(const auto &name : {QStringLiteral("claimed"), QStringLiteral("done"), QStringLiteral("failed"), QStringLiteral("artifacts")})
+		spoolSubDir(spoolDir, name);
+
+	writeJson(QDir{spoolDir}.absoluteFilePath(QStringLiteral("plan.json")), planToJson(plan, shards).object());
+	for(const auto &task : plan)
+		writeJson(queueDir.absoluteFilePath(task.name + QStringLiteral(".json")), taskToJson(task));
+	qDebug() << "Queued" << plan.size() << "packages in spool directory" << spoolDir;
+}
+
+int BuildFarm::runWorker(const QString &spoolDir, const QString &workerId, int shard, QStringList command) const
+{
+	if(command.isEmpty())
+		throw QStringLiteral("You must specify a build command for the worker");
+	const auto bin = QStandardPaths::findExecutable(command.first());
+	if(bin.isNull())
+		throw QStringLiteral("Unable to find binary \"%1\" in PATH").arg(command.first());
+	command[0] = bin;
+
+	const QDir spool{spoolDir};
+	if(!spool.exists(QStringLiteral("plan.json")))
+		throw QStringLiteral("%1 is not a repkg spool directory").arg(spoolDir);
+	const auto queueDir = spoolSubDir(spoolDir, QStringLiteral("queue"));
+	const auto claimDir = spoolSubDir(spoolDir, QStringLiteral("claimed"));
+	const auto doneDir = spoolSubDir(spoolDir, QStringLiteral("done"));
+	const auto failedDir = spoolSubDir(spoolDir, QStringLiteral("failed"));
+
+	auto result = EXIT_SUCCESS;
+	forever {
+		requeueStaleClaims(queueDir, claimDir);
+
+		QList<Task> queued;
+		for(const auto &fileInfo : queueDir.entryInfoList({QStringLiteral("*.json")}, QDir::Files)) {
+			QFile file{fileInfo.absoluteFilePath()};
+			if(file.open(QIODevice::ReadOnly)) // might have been claimed in the meantime
+				queued.append(taskFromJson(QJsonDocument::fromJson(file.readAll()).object()));
+		}
+		if(queued.isEmpty()) {
+			// a claim can still be abandoned, and must then be built by someone else
+			if(claimDir.entryList({QStringLiteral("*.json")}, QDir::Files).isEmpty())
+				break;
+			QThread::sleep(1);
+			continue;
+		}
+
+		// prefer tasks of our own shard, then the most expensive ones
+		std::stable_sort(queued.begin(), queued.end(), [shard](const Task &lhs, const Task &rhs) {
+			const auto lhsOwn = shard < 0 || lhs.shard == shard;
+			const auto rhsOwn = shard < 0 || rhs.shard == shard;
+			if(lhsOwn != rhsOwn)
+				return lhsOwn;
+			return lhs.cost > rhs.cost;
+		});
+
+		std::optional<Task> next;
+		for(const auto &task : qAsConst(queued)) {
+			auto ready = true;
+			QString failedDep;
+			for(const auto &dep : task.after) {
+				if(failedDir.exists(dep + QStringLiteral(".json"))) {
+					failedDep = dep;
+					break;
+				} else if(!doneDir.exists(dep + QStringLiteral(".json")))
+					ready = false;
+			}
+
+			// claiming is an atomic rename, only one worker can win
+			const auto fileName = task.name + QStringLiteral(".json");
+			if(!failedDep.isNull()) {
+				if(QFile::rename(queueDir.absoluteFilePath(fileName), claimDir.absoluteFilePath(fileName))) {
+					auto object = taskToJson(task);
+					object.insert(QStringLiteral("worker"), workerId);
+					object.insert(QStringLiteral("reason"), QStringLiteral("Dependency %1 failed").arg(failedDep));
+					writeJson(failedDir.absoluteFilePath(fileName), object);
+					QFile::remove(claimDir.absoluteFilePath(fileName));
+					qWarning().noquote() << QStringLiteral("[%1] Skipping %2, dependency %3 failed").arg(workerId, task.name, failedDep);
+				}
+			} else if(ready &&
+					  QFile::rename(queueDir.absoluteFilePath(fileName), claimDir.absoluteFilePath(fileName))) {
+				// record who owns the claim, so other workers can tell if it was abandoned
+				auto object = taskToJson(task);
+				object.insert(QStringLiteral("worker"), workerId);
+				object.insert(QStringLiteral("host"), QSysInfo::machineHostName());
+				object.insert(QStringLiteral("pid"), QCoreApplication::applicationPid());
+				writeJson(claimDir.absoluteFilePath(fileName), object);
+				next = task;
+				break;
+			}
+		}
+
+		if(next) {
+			if(!buildTask(spool, *next, workerId, command))
+				result = EXIT_FAILURE;
+		} else // everything left waits for packages built by other workers
+			QThread::sleep(1);
+	}
+
+	qDebug() << "Worker" << workerId << "finished, no more packages queued or claimed";
+	return result;
+}
+
+void BuildFarm::requeueStaleClaims(const QDir &queueDir, const QDir &claimDir)
+{
+	const auto host = QSysInfo::machineHostName();
+	const auto now = QDateTime::currentDateTimeUtc();
+	for(const auto &fileInfo : claimDir.entryInfoList({QStringLiteral("*.json")}, QDir::Files)) {
+		QFile file{fileInfo.absoluteFilePath()};
+		if(!file.open(QIODevice::ReadOnly)) // might have been finished in the meantime
+			continue;
+		const auto object = QJsonDocument::fromJson(file.readAll()).object();
+		file.close();
+
+		// workers on this host can be checked directly, all others only via their heartbeat
+		QString reason;
+		const auto pid = static_cast<pid_t>(object.value(QStringLiteral("pid")).toInt());
+		if(object.value(QStringLiteral("host")).toString() == host && pid > 0 &&
+		   ::kill(pid, 0) == -1 && errno == ESRCH)
+			reason = QStringLiteral("its worker process %1 does not exist anymore").arg(pid);
+		else if(fileInfo.metadataChangeTime().secsTo(now) > StaleClaimTimeout)
+			reason = QStringLiteral("its worker did not report back for %1 seconds").arg(StaleClaimTimeout);
+		else
+			continue;
+
+		// requeuing is an atomic rename as well, so only one worker requeues the claim
+		if(QFile::rename(fileInfo.absoluteFilePath(), queueDir.absoluteFilePath(fileInfo.fileName()))) {
+			qWarning().noquote() << QStringLiteral("Requeued %1, as %2")
+									.arg(object.value(QStringLiteral("name")).toString(), reason);
+		}
+	}
+}
+
+QJsonObject BuildFarm::taskToJson(const Task &task)
+{
+	return QJsonObject {
+		{QStringLiteral("name"), task.name},
+		{QStringLiteral("triggers"), QJsonArray::fromStringList(task.triggers)},
+		{QStringLiteral("after"), QJsonArray::fromStringList(task.after)},
+		{QStringLiteral("cost"), static_cast<qint64>(task.cost)},
+		{QStringLiteral("wave"), task.wave},
+		{QStringLiteral("shard"), task.shard}
+	};
+}
+
+BuildFarm::Task BuildFarm::taskFromJson(const QJsonObject &object)
+{
+	Task task;
+	task.name = object.value(QStringLiteral("name")).toString();
+	for(const auto &value : object.value(QStringLiteral("triggers")).toArray())
+		task.triggers.append(value.toString());
+	for(const auto &value : object.value(QStringLiteral("after")).toArray())
+		task.after.append(value.toString());
+	task.cost = static_cast<quint64>(object.value(QStringLiteral("cost")).toDouble());
+	task.wave = object.value(QStringLiteral("wave")).toInt();
+	task.shard = object.value(QStringLiteral("shard")).toInt();
+	return task;
+}
+
+QDir BuildFarm::spoolSubDir(const QString &spoolDir, const QString &name)
+{
+	QDir dir{spoolDir};
+	if(!dir.mkpath(name) || !dir.cd(name))
+		throw QStringLiteral("Failed to create spool directory %1").arg(dir.absoluteFilePath(name));
+	return dir;
+}
+
+bool BuildFarm::buildTask(const QDir &spool, const Task &task, const QString &workerId, const QStringList &command)
+{
+	const auto fileName = task.name + QStringLiteral(".json");
+	const auto workDir = spoolSubDir(spool.absoluteFilePath(QStringLiteral("work")), task.name);
+	const auto artifactDir = spoolSubDir(spool.absoluteFilePath(QStringLiteral("artifacts")), task.name);
+
+	QProcess proc;
+	proc.setProgram(command.first());
+	proc.setArguments(command.mid(1) + QStringList{task.name});
+	proc.setWorkingDirectory(workDir.absolutePath());
+	proc.setProcessChannelMode(QProcess::ForwardedChannels);
+	auto env = QProcessEnvironment::systemEnvironment();
+	env.insert(QStringLiteral("PKGDEST"), artifactDir.absolutePath());
+	env.insert(QStringLiteral("REPKG_SPOOL"), spool.absolutePath());
+	env.insert(QStringLiteral("REPKG_WORKER"), workerId);
+	proc.setProcessEnvironment(env);
+
+	qInfo().noquote() << QStringLiteral("[%1] Building %2...").arg(workerId, task.name);
+	// tuned rebuilds on the same machine share the idle cores with the worker
+	BuildProfile::registerBuild();
+	QElapsedTimer timer;
+	timer.start();
+	proc.start();
+	// touching the claim changes it's ctime, which is the heartbeat other workers check
+	const auto claimPath = spool.absoluteFilePath(QStringLiteral("claimed/") + fileName);
+	auto finished = proc.waitForStarted(-1);
+	while(finished && !proc.waitForFinished(HeartbeatInterval)) {
+		if(proc.state() == QProcess::NotRunning)
+			finished = false;
+		else {
+			QFile claim{claimPath};
+			if(claim.open(QIODevice::ReadWrite | QIODevice::ExistingOnly))
+				claim.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+		}
+	}
+	const auto ok = finished &&
+					proc.exitStatus() == QProcess::NormalExit &&
+					proc.exitCode() == EXIT_SUCCESS;
+
+	QJsonObject object {
+		{QStringLiteral("name"), task.name},
+		{QStringLiteral("worker"), workerId},
+		{QStringLiteral("seconds"), timer.elapsed() / 1000.0}
+	};
+	if(ok) {
+		QJsonArray artifacts;
+		for(const auto &artifact : artifactDir.entryList(QDir::Files))
+			artifacts.append(artifactDir.absoluteFilePath(artifact));
+		object.insert(QStringLiteral("artifacts"), artifacts);
+		writeJson(spool.absoluteFilePath(QStringLiteral("done/") + fileName), object);
+	} else {
+		object.insert(QStringLiteral("exitCode"), proc.exitCode());
+		writeJson(spool.absoluteFilePath(QStringLiteral("failed/") + fileName), object);
+		qWarning().noquote() << QStringLiteral("[%1] Failed to build %2").arg(workerId, task.name);
+	}
+	BuildProfile::unregisterBuild();
+	QFile::remove(spool.absoluteFilePath(QStringLiteral("claimed/") + fileName));
+	return ok;
+}
+
+void BuildFarm::writeJson(const QString &path, const QJsonObject &object)
+{
+	// write atomically, as other workers might read the file at any time
+	QSaveFile file{path};
+	if(!file.open(QIODevice::WriteOnly) ||
+	   file.write(QJsonDocument{object}.toJson(QJsonDocument::Compact)) == -1 ||
+	   !file.commit()) {
+		throw QStringLiteral("Failed to write spool file %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef BUILDFARM_H
+#define BUILDFARM_H
+
+#include "pacmanrunner.h"
+#include "pkgresolver.h"
+
+#include <QObject>
+#include <QDir>
+#include <QJsonDocument>
+
+class BuildFarm : public QObject
+{
+	Q_OBJECT
+
+public:
+	struct Task {
+		QString name;
+		QStringList triggers;
+		QStringList after; // pending packages that must be built before this one
+		quint64 cost = 0;
+		int wave = 0;
+		int shard = 0;
+	};
+
+	explicit BuildFarm(PacmanRunner *runner, PkgResolver *resolver, QObject *parent = nullptr);
+
+	QList<Task> createPlan(int shards) const;
+	static QJsonDocument planToJson(const QList<Task> &plan, int shards);
+	static QString planToText(const QList<Task> &plan, int shards);
+
+	void writeSpool(const QString &spoolDir, const QList<Task> &plan, int shards) const;
+	int runWorker(const QString &spoolDir, const QString &workerId, int shard, QStringList command) const;
+
+private:
+	PacmanRunner *_runner;
+	PkgResolver *_resolver;
+
+	static QJsonObject taskToJson(const Task &task);
+	static Task taskFromJson(const QJsonObject &object);
+	static void requeueStaleClaims(const QDir &queueDir, const QDir &claimDir);
+	static QDir spoolSubDir(const QString &spoolDir, const QString &name);
+	static bool buildTask(const QDir &spool, const Task &task, const QString &workerId, const QStringList &command);
+	static void writeJson(const QString &path, const QJsonObject &object);
+};
+
+#endif // BUILDFARM_H
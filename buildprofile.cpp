@@ -0,0 +1,224 @@
+#include "buildprofile.h"
+#include "admissioncontrol.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QStorageInfo>
+#include <QThread>
+#include <cmath>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// only a real directory of the user, that nobody else can write to, is safe to build in
+bool isPrivateDir(const QString &path)
+{
+	struct stat pathStat;
+	if(::lstat(QFile::encodeName(path).constData(), &pathStat) != 0)
+		return false;
+	return S_ISDIR(pathStat.st_mode) &&
+			pathStat.st_uid == ::getuid() &&
+			(pathStat.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+}
+
+BuildProfile::BuildProfile(PacmanRunner *runner, QObject *parent) :
+	QObject{parent},
+	_runner{runner},
+	_stats{new QSettings{
+		QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QStringLiteral("/buildstats.conf"),
+		QSettings::IniFormat,
+		this
+	}},
+	_diskBuildDir{QDir{QStandardPaths::writableLocation(QStandardPaths::CacheLocation)}.absoluteFilePath(QStringLiteral("build"))}
+{}
+
+bool BuildProfile::isEnabled()
+{
+	QSettings settings;
+	return settings.value(QStringLiteral("profile/enabled"), false).toBool();
+}
+
+void BuildProfile::setEnabled(bool enabled)
+{
+	QSettings settings;
+	if(enabled)
+		settings.setValue(QStringLiteral("profile/enabled"), true);
+	else
+		settings.remove(QStringLiteral("profile"));
+	qDebug() << (enabled ? "Enabled" : "Disabled") << "tuned build environments";
+}
+
+QProcessEnvironment BuildProfile::environment(const QStringList &pkgs, int concurrentJobs)
+{
+	auto env = QProcessEnvironment::systemEnvironment();
+	const auto snapshot = AdmissionControl::readSnapshot();
+
+	// build in memory if the last build of the packages fits into the free RAM, leaving enough for compiling
+	auto buildDir = _diskBuildDir;
+	const auto buildSize = recordedBuildSize(readPkgBases(pkgs));
+	const auto tmpfs = tmpfsPath();
+	if(buildSize > 0 && !tmpfs.isNull()) {
+		const auto tmpfsFree = static_cast<quint64>(QStorageInfo{tmpfs}.bytesAvailable());
+		if(buildSize <= std::min(tmpfsFree, snapshot.availableMemory / 2)) {
+			const auto tmpfsDir = createTmpfsBuildDir();
+			if(!tmpfsDir.isNull())
+				buildDir = tmpfsDir;
+		}
+	}
+	if(buildDir == _diskBuildDir && !QDir{}.mkpath(buildDir))
+		throw QStringLiteral("Failed to create build directory %1").arg(buildDir);
+	env.insert(QStringLiteral("BUILDDIR"), buildDir);
+
+	// use all cores that are not busy, shared among the builds running at the same time
+	if(!env.contains(QStringLiteral("MAKEFLAGS"))) {
+		const auto freeCores = std::max(1, QThread::idealThreadCount() - static_cast<int>(std::floor(snapshot.load)));
+		env.insert(QStringLiteral("MAKEFLAGS"), QStringLiteral("-j%1").arg(std::max(1, freeCores / std::max(1, concurrentJobs))));
+	}
+
+	// the packages are only installed locally, so compressing them is a waste of time
+	env.insert(QStringLiteral("PKGEXT"), QStringLiteral(".pkg.tar"));
+
+	qDebug() << "Building" << pkgs << "in" << buildDir << "with" << env.value(QStringLiteral("MAKEFLAGS"));
+	return env;
+}
+
+int BuildProfile::registerBuild()
+{
+	// every process builds one thing at a time, so the running builds are tracked by pid
+	const auto path = runningBuildsDir();
+	if(path.isNull())
+		return 1;
+	QDir dir{path};
+	const auto pidFile = QFile::encodeName(dir.absoluteFilePath(QString::number(QCoreApplication::applicationPid())));
+	const auto fd = ::open(pidFile.constData(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if(fd != -1)
+		::close(fd);
+
+	auto jobs = 0;
+	for(const auto &entry : dir.entryList(QDir::Files | QDir::System)) {
+		auto ok = false;
+		const auto pid = static_cast<pid_t>(entry.toInt(&ok));
+		struct stat entryStat;
+		if(!ok ||
+		   ::lstat(QFile::encodeName(dir.absoluteFilePath(entry)).constData(), &entryStat) != 0 ||
+		   !S_ISREG(entryStat.st_mode) ||
+		   entryStat.st_uid != ::getuid())
+			continue;
+		if(::kill(pid, 0) == 0 || errno == EPERM)
+			jobs++;
+		else // left behind by a process that did not finish it's build
+			dir.remove(entry);
+	}
+	return std::max(jobs, 1);
+}
+
+void BuildProfile::unregisterBuild()
+{
+	const auto path = runningBuildsDir();
+	if(!path.isNull())
+		QFile::remove(QDir{path}.absoluteFilePath(QString::number(QCoreApplication::applicationPid())));
+}
+
+void BuildProfile::finish(const QStringList &pkgs)
+{
+	// remember how large the builds got, and free the space again
+	for(const auto &pkgBase : readPkgBases(pkgs)) {
+		quint64 size = 0;
+		for(const auto &buildDir : {_tmpfsBuildDir, _diskBuildDir}) {
+			if(buildDir.isNull())
+				continue;
+			QDir dir{QDir{buildDir}.absoluteFilePath(pkgBase)};
+			if(!dir.exists())
+				continue;
+			QDirIterator iterator{dir.absolutePath(), QDir::Files | QDir::Hidden | QDir::System | QDir::NoSymLinks, QDirIterator::Subdirectories};
+			while(iterator.hasNext()) {
+				iterator.next();
+				size += static_cast<quint64>(iterator.fileInfo().size());
+			}
+			dir.removeRecursively();
+		}
+		if(size > 0)
+			_stats->setValue(QStringLiteral("buildsize/") + pkgBase, size);
+	}
+	_stats->sync();
+
+	if(!_tmpfsBuildDir.isNull()) {
+		QDir{_tmpfsBuildDir}.removeRecursively();
+		_tmpfsBuildDir.clear();
+	}
+}
+
+QString BuildProfile::runningBuildsDir()
+{
+	// private to the user, so nobody else can add, replace or keep entries in it
+	const auto runtimeDir = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+	if(runtimeDir.isEmpty())
+		return {};
+	const auto path = QDir{runtimeDir}.absoluteFilePath(QStringLiteral("repkg-builds"));
+	::mkdir(QFile::encodeName(path).constData(), 0700);
+	if(!isPrivateDir(path)) {
+		qWarning() << "Not tracking running builds, as" << path << "is not a private directory";
+		return {};
+	}
+	return path;
+}
+
+QString BuildProfile::tmpfsPath()
+{
+	for(const auto &path : {QDir::tempPath(), QStringLiteral("/dev/shm")}) {
+		if(QStorageInfo{path}.fileSystemType() == "tmpfs")
+			return path;
+	}
+	return {};
+}
+
+QString BuildProfile::createTmpfsBuildDir()
+{
+	// the shared tmpfs is writable by everyone, so the directory gets an unpredictable name and mode 0700
+	if(!_tmpfsBuildDir.isNull())
+		QDir{_tmpfsBuildDir}.removeRecursively();
+	auto pattern = QFile::encodeName(QDir{tmpfsPath()}.absoluteFilePath(QStringLiteral("repkg-%1-XXXXXX").arg(::getuid())));
+	if(!::mkdtemp(pattern.data()) || !isPrivateDir(QFile::decodeName(pattern))) {
+		qWarning() << "Failed to create a private build directory in" << tmpfsPath() << "- building on disk";
+		_tmpfsBuildDir.clear();
+		return {};
+	}
+	_tmpfsBuildDir = QFile::decodeName(pattern);
+	return _tmpfsBuildDir;
+}
+
+quint64 BuildProfile::recordedBuildSize(const QStringList &pkgBases) const
+{
+	// unknown builds are assumed to be too large
+	quint64 size = 0;
+	for(const auto &pkgBase : pkgBases) {
+		const auto baseSize = _stats->value(QStringLiteral("buildsize/") + pkgBase, 0).toULongLong();
+		if(baseSize == 0)
+			return 0;
+		size += baseSize;
+	}
+	return size;
+}
+
+QStringList BuildProfile::readPkgBases(const QStringList &pkgs) const
+{
+	QStringList pkgBases;
+	for(const auto &pkg : pkgs) {
+		const auto pkgBase = _runner->readPackageBase(pkg);
+		if(!pkgBases.contains(pkgBase))
+			pkgBases.append(pkgBase);
+	}
+	return pkgBases;
+}
@@ -0,0 +1,40 @@
+#ifndef BUILDPROFILE_H
+#define BUILDPROFILE_H
+
+#include "pacmanrunner.h"
+
+#include <QDir>
+#include <QObject>
+#include <QProcessEnvironment>
+#include <QSettings>
+
+class BuildProfile : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit BuildProfile(PacmanRunner *runner, QObject *parent = nullptr);
+
+	static bool isEnabled();
+	static void setEnabled(bool enabled);
+
+	QProcessEnvironment environment(const QStringList &pkgs, int concurrentJobs);
+	void finish(const QStringList &pkgs);
+
+	static int registerBuild(); // -> number of builds of the user running on this machine, including this one
+	static void unregisterBuild();
+
+private:
+	PacmanRunner *_runner;
+	QSettings *_stats;
+	QString _diskBuildDir;
+	QString _tmpfsBuildDir;
+
+	static QString runningBuildsDir();
+	static QString tmpfsPath();
+	QString createTmpfsBuildDir();
+	quint64 recordedBuildSize(const QStringList &pkgBases) const;
+	QStringList readPkgBases(const QStringList &pkgs) const;
+};
+
+#endif // BUILDPROFILE_H
@@ -0,0 +1,345 @@
+#include "chrootbuilder.h"
+#include "admissioncontrol.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFileInfo>
+#include <QQueue>
+#include <QRegularExpression>
+#include <QSettings>
+#include <QStandardPaths>
+
+#include <cerrno>
+#include <csignal>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace {
+
+// the packages every snapshot starts with
+const QStringList BasePackages {
+	QStringLiteral("base-devel"),
+	QStringLiteral("pacman")
+};
+
+QString dependName(const QString &depend)
+{
+	// strips version constraints like foo>=1.0, and the versions of provides like libfoo.so=1-64
+	static const QRegularExpression versionRegex{QStringLiteral("[<>=].*$")};
+	return QString{depend}.remove(versionRegex);
+}
+
+// <base> <host sync dir> <n> <n stale snapshots...> <packages...>
+// the sync databases are copied from the host, so the packages come from it's cache without network access
+const QString PrepareScript = QStringLiteral(R"__(
+base="$1"; syncdir="$2"; stale="$3"; shift 3
+while [ "$stale" -gt 0 ]; do
+	rm -rf --one-file-system "$1"
+	shift
+	stale=$((stale - 1))
+done
+mkdir -p "$base/var/lib/pacman/sync"
+cp -f "$syncdir"/*.db "$base/var/lib/pacman/sync/"
+pacman --root "$base" --noconfirm --needed -Su "$@"
+)__");
+
+// <base> <snapshot> <repository> <pkgdest> <srcdest> <uid:gid> <makeflags> <pkgext> <n> <n package files...> <build depends...>
+// everything happens in a private mount namespace, so the mounts disappear with the script in any case.
+// Only the paths of the built packages are written to stdout.
+const QString BuildScript = QStringLiteral(R"__(
+base="$1"; snap="$2"; repo="$3"; dest="$4"; srcdest="$5"; user="$6"; makeflags="$7"; pkgext="$8"; files="$9"; shift 9
+exec 3>&1 1>&2
+mkdir -p "$snap/upper" "$snap/work" "$snap/merged" "$snap/foreign"
+trap 'umount -R "$snap/merged" 2>/dev/null; mountpoint -q "$snap/merged" || rm -rf --one-file-system "$snap"' EXIT
+while [ "$files" -gt 0 ]; do
+	ln -s "$1" "$snap/foreign/"
+	shift
+	files=$((files - 1))
+done
+mount -t overlay overlay -o "lowerdir=$base,upperdir=$snap/upper,workdir=$snap/work" "$snap/merged"
+mount -t proc proc "$snap/merged/proc"
+mount --bind /dev "$snap/merged/dev"
+if [ "$#" -gt 0 ]; then
+	pacman --root "$snap/merged" --noconfirm --needed --asdeps -S "$@"
+fi
+if [ -n "$(ls -A "$snap/foreign")" ]; then
+	pacman --root "$snap/merged" --noconfirm --needed --asdeps -U "$snap/foreign"/*
+fi
+cp -r "$repo" "$snap/merged/build"
+mkdir -p "$snap/merged/pkgdest" "$snap/merged/srcdest"
+chown -R "$user" "$snap/merged/build" "$snap/merged/pkgdest" "$snap/merged/srcdest"
+if [ -n "$srcdest" ]; then
+	mount --bind "$srcdest" "$snap/merged/srcdest"
+fi
+chroot --userspec="$user" "$snap/merged" /usr/bin/env -i \
+	PATH=/usr/bin HOME=/build PKGDEST=/pkgdest SRCDEST=/srcdest \
+	MAKEFLAGS="$makeflags" PKGEXT="$pkgext" \
+	sh -c 'cd /build && makepkg --force --noconfirm'
+for file in "$snap/merged/pkgdest"/*; do
+	[ -f "$file" ] || continue
+	cp -f "$file" "$dest/"
+	chown "$user" "$dest/${file##*/}"
+	echo "$dest/${file##*/}" >&3
+done
+)__");
+
+}
+
+ChrootBuilder::ChrootBuilder(PacmanRunner *runner, QObject *parent) :
+	QObject{parent},
+	_runner{runner},
+	_dir{directory()}
+{}
+
+QString ChrootBuilder::directory()
+{
+	QSettings settings;
+	return settings.value(QStringLiteral("chroot/directory")).toString();
+}
+
+void ChrootBuilder::setDirectory(const QString &directory)
+{
+	QSettings settings;
+	if(directory.isEmpty()) {
+		settings.remove(QStringLiteral("chroot"));
+		qDebug() << "Disabled clean chroot builds";
+	} else {
+		settings.setValue(QStringLiteral("chroot/directory"), QDir{directory}.absolutePath());
+		qDebug() << "Building in clean chroots in" << directory;
+	}
+}
+
+void ChrootBuilder::prepare()
+{
+	if(!_dir.mkpath(QStringLiteral("snapshots")))
+		throw QStringLiteral("Failed to create chroot directory %1").arg(_dir.absolutePath());
+
+	// the base is the lower layer of all snapshots, so builds hold a shared lock on it while they run
+	const auto baseDir = _dir.absoluteFilePath(QStringLiteral("root"));
+	const auto initialized = QDir{baseDir}.exists(QStringLiteral("var/lib/pacman/local"));
+	QFile lock;
+	if(!lockRoot(lock, initialized ? LOCK_EX | LOCK_NB : LOCK_EX)) {
+		if(initialized && errno == EWOULDBLOCK) {
+			qInfo() << "Not updating the chroot, it is used by running builds";
+			return;
+		}
+		throw QStringLiteral("Failed to lock the chroot in %1").arg(_dir.absolutePath());
+	}
+
+	// builds that were killed before they could clean up leave their snapshot behind
+	const QDir snapshotDir{_dir.absoluteFilePath(QStringLiteral("snapshots"))};
+	QStringList staleSnapshots;
+	for(const auto &snapshot : snapshotDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+		const auto pid = static_cast<pid_t>(snapshot.section(QLatin1Char('-'), -1).toInt());
+		if(pid <= 0 || (::kill(pid, 0) == -1 && errno == ESRCH))
+			staleSnapshots.append(snapshotDir.absoluteFilePath(snapshot));
+	}
+	if(!staleSnapshots.isEmpty())
+		qDebug() << "Removing" << staleSnapshots.size() << "snapshots of interrupted builds";
+
+	const auto syncDbs = _runner->listSyncDbs();
+	if(syncDbs.isEmpty())
+		throw QStringLiteral("No sync databases found to create the chroot from - run pacman -Sy first");
+
+	QProcess proc;
+	initScript(proc, PrepareScript, QStringList {
+				   baseDir,
+				   QFileInfo{syncDbs.first()}.absolutePath(),
+				   QString::number(staleSnapshots.size())
+			   } + staleSnapshots + BasePackages);
+	proc.setProcessChannelMode(QProcess::ForwardedChannels);
+	qInfo() << "Updating the chroot in" << baseDir << "...";
+	proc.start();
+	proc.waitForFinished(-1);
+	if(proc.exitStatus() != QProcess::NormalExit || proc.exitCode() != EXIT_SUCCESS)
+		throw QStringLiteral("Failed to update the chroot in %1").arg(baseDir);
+}
+
+QStringList ChrootBuilder::build(const QString &buildDir, const QString &pkgDest, const QStringList &pkgs, AdmissionControl *admission, const QProcessEnvironment &env)
+{
+	if(!QDir{}.mkpath(pkgDest))
+		throw QStringLiteral("Failed to create package destination %1").arg(pkgDest);
+
+	// the base must not be updated while it is mounted, but other builds can use it as well
+	QFile lock;
+	if(!lockRoot(lock, LOCK_SH))
+		throw QStringLiteral("Failed to lock the chroot in %1").arg(_dir.absolutePath());
+
+	// each build gets it's own snapshot, so builds of multiple processes can run side by side
+	const auto snapshot = _dir.absoluteFilePath(QStringLiteral("snapshots/%1-%2")
+												.arg(QFileInfo{buildDir}.fileName())
+												.arg(QCoreApplication::applicationPid()));
+	auto depends = readBuildDepends(buildDir);
+	const auto foreignFiles = findForeignPackages(pkgDest, depends);
+	QProcess proc;
+	initScript(proc, BuildScript, QStringList {
+				   _dir.absoluteFilePath(QStringLiteral("root")),
+				   snapshot,
+				   buildDir,
+				   QDir{pkgDest}.absolutePath(),
+				   env.value(QStringLiteral("SRCDEST")),
+				   buildUser(),
+				   env.value(QStringLiteral("MAKEFLAGS")),
+				   env.value(QStringLiteral("PKGEXT"), QStringLiteral(".pkg.tar.zst")),
+				   QString::number(foreignFiles.size())
+			   } + foreignFiles + depends);
+	proc.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+	qDebug() << "Building packages of" << buildDir << "in snapshot" << snapshot << "...";
+	if(admission) {
+		if(admission->execute(proc, pkgs) != EXIT_SUCCESS)
+			return {};
+	} else {
+		proc.start();
+		proc.waitForFinished(-1);
+		if(proc.exitStatus() != QProcess::NormalExit || proc.exitCode() != EXIT_SUCCESS)
+			return {};
+	}
+	return QString::fromUtf8(proc.readAllStandardOutput()).split(QLatin1Char('\n'), QString::SkipEmptyParts);
+}
+
+QStringList ChrootBuilder::readBuildDepends(const QString &buildDir) const
+{
+	const auto makepkg = QStandardPaths::findExecutable(QStringLiteral("makepkg"));
+	if(makepkg.isNull())
+		throw QStringLiteral("Unable to find makepkg binary in PATH");
+
+	QProcess proc;
+	proc.setProgram(makepkg);
+	proc.setArguments({QStringLiteral("--printsrcinfo")});
+	proc.setWorkingDirectory(buildDir);
+	proc.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+	proc.start();
+	proc.waitForFinished(-1);
+	if(proc.exitStatus() != QProcess::NormalExit || proc.exitCode() != EXIT_SUCCESS)
+		throw QStringLiteral("Failed to read the build dependencies of %1").arg(buildDir);
+
+	// only what the build needs is installed into the snapshot, including architecture specific entries
+	static const QRegularExpression dependRegex{QStringLiteral(R"__(^\s*(?:make|check)?depends(?:_[\w]+)?\s*=\s*(.+?)\s*$)__")};
+	QStringList depends;
+	for(const auto &line : QString::fromUtf8(proc.readAllStandardOutput()).split(QLatin1Char('\n'))) {
+		const auto match = dependRegex.match(line);
+		if(match.hasMatch() && !depends.contains(match.captured(1)))
+			depends.append(match.captured(1));
+	}
+	return depends;
+}
+
+QStringList ChrootBuilder::findForeignPackages(const QString &pkgDest, QStringList &depends) const
+{
+	// foreign packages (like the ones rebuilt in earlier waves) are not in the sync databases
+	QHash<QString, QString> foreign; // package or provided name -> package
+	const auto foreignPkgs = _runner->readForeignPackages();
+	for(const auto &pkg : foreignPkgs)
+		foreign.insert(pkg, pkg);
+	for(const auto &pkg : foreignPkgs) {
+		for(const auto &provide : _runner->readLocalDesc(pkg).value(QStringLiteral("PROVIDES"))) {
+			if(!foreign.contains(dependName(provide)))
+				foreign.insert(dependName(provide), pkg);
+		}
+	}
+
+	QStringList syncDepends;
+	QQueue<QString> pkgQueue;
+	for(const auto &depend : qAsConst(depends)) {
+		const auto pkg = foreign.value(dependName(depend));
+		if(pkg.isNull())
+			syncDepends.append(depend);
+		else
+			pkgQueue.enqueue(pkg);
+	}
+	depends = syncDepends;
+
+	// install the files of the installed versions, together with all foreign packages they depend on.
+	// Dependencies from the sync databases are resolved by pacman itself
+	const QStringList searchDirs {
+		pkgDest,
+		QStringLiteral("/var/cache/pacman/pkg")
+	};
+	QStringList files;
+	QSet<QString> handled;
+	while(!pkgQueue.isEmpty()) {
+		const auto pkg = pkgQueue.dequeue();
+		if(handled.contains(pkg))
+			continue;
+		handled.insert(pkg);
+
+		const auto desc = _runner->readLocalDesc(pkg);
+		const auto pattern = QStringLiteral("%1-%2-%3.pkg.tar*").arg(pkg,
+																	 desc.value(QStringLiteral("VERSION")).value(0),
+																	 desc.value(QStringLiteral("ARCH")).value(0));
+		QString file;
+		for(const auto &dir : searchDirs) {
+			for(const auto &fileInfo : QDir{dir}.entryInfoList({pattern}, QDir::Files)) {
+				if(fileInfo.suffix() != QStringLiteral("sig")) {
+					file = fileInfo.absoluteFilePath();
+					break;
+				}
+			}
+			if(!file.isNull())
+				break;
+		}
+		if(file.isNull()) {
+			qWarning() << "Unable to find the package file of" << pkg << "to install it into the chroot";
+			continue;
+		}
+
+		files.append(file);
+		for(const auto &depend : desc.value(QStringLiteral("DEPENDS"))) {
+			const auto depPkg = foreign.value(dependName(depend));
+			if(!depPkg.isNull())
+				pkgQueue.enqueue(depPkg);
+		}
+	}
+	return files;
+}
+
+QString ChrootBuilder::buildUser() const
+{
+	// makepkg refuses to run as root, so the build runs as the calling user - or nobody
+	if(!global::isRoot())
+		return QStringLiteral("%1:%2").arg(::getuid()).arg(::getgid());
+	const auto env = QProcessEnvironment::systemEnvironment();
+	if(env.contains(QStringLiteral("SUDO_UID")) && env.value(QStringLiteral("SUDO_UID")) != QStringLiteral("0")) {
+		return QStringLiteral("%1:%2").arg(env.value(QStringLiteral("SUDO_UID")),
+										  env.value(QStringLiteral("SUDO_GID")));
+	}
+	return QStringLiteral("65534:65534");
+}
+
+bool ChrootBuilder::lockRoot(QFile &lock, int operation) const
+{
+	// only the lock matters, so builds of other users do not need write access to the file
+	lock.setFileName(_dir.absoluteFilePath(QStringLiteral("root.lock")));
+	if(!lock.open(QIODevice::ReadOnly) && !lock.open(QIODevice::ReadWrite))
+		return false;
+	return ::flock(lock.handle(), operation) == 0;
+}
+
+void ChrootBuilder::initScript(QProcess &proc, const QString &script, const QStringList &args) const
+{
+	// mounting and installing into the snapshots needs root, but only inside a private mount namespace
+	const auto unshare = QStandardPaths::findExecutable(QStringLiteral("unshare"));
+	if(unshare.isNull())
+		throw QStringLiteral("Unable to find unshare binary in PATH");
+	QStringList arguments {
+		unshare,
+		QStringLiteral("--mount"),
+		QStringLiteral("--propagation"),
+		QStringLiteral("private"),
+		QStringLiteral("/bin/sh"),
+		QStringLiteral("-e"),
+		QStringLiteral("-c"),
+		script,
+		QStringLiteral("repkg-chroot")
+	};
+	arguments.append(args);
+
+	if(!global::isRoot()) {
+		const auto sudo = QStandardPaths::findExecutable(QStringLiteral("sudo"));
+		if(sudo.isNull())
+			throw QStringLiteral("Unable to find sudo binary in PATH");
+		proc.setProgram(sudo);
+	} else
+		proc.setProgram(arguments.takeFirst());
+	proc.setArguments(arguments);
+}
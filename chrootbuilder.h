@@ -0,0 +1,39 @@
+#ifndef CHROOTBUILDER_H
+#define CHROOTBUILDER_H
+
+#include "pacmanrunner.h"
+
+#include <QDir>
+#include <QFile>
+#include <QObject>
+#include <QProcessEnvironment>
+
+class ChrootBuilder : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit ChrootBuilder(PacmanRunner *runner, QObject *parent = nullptr);
+
+	static QString directory();
+	static void setDirectory(const QString &directory);
+
+	void prepare();
+	QStringList build(const QString &buildDir,
+					  const QString &pkgDest,
+					  const QStringList &pkgs,
+					  AdmissionControl *admission = nullptr,
+					  const QProcessEnvironment &env = QProcessEnvironment::systemEnvironment()); // -> built package files
+
+private:
+	PacmanRunner *_runner;
+	QDir _dir;
+
+	QStringList readBuildDepends(const QString &buildDir) const;
+	QStringList findForeignPackages(const QString &pkgDest, QStringList &depends) const; // -> package files, removes them from depends
+	QString buildUser() const;
+	bool lockRoot(QFile &lock, int operation) const;
+	void initScript(QProcess &proc, const QString &script, const QStringList &args) const;
+};
+
+#endif // CHROOTBUILDER_H
@@ -2,7 +2,11 @@
 
 #include <QCoreApplication>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QProcess>
+#include <QStandardPaths>
+#include <QSysInfo>
 
 bool CliController::_verbose = false;
 
@@ -11,7 +15,10 @@ CliController::CliController(QObject *parent) :
 	_parser{new QCliParser{}},
 	_runner{new PacmanRunner{this}},
 	_rules{new RuleController{_runner, this}},
-	_resolver{new PkgResolver{_runner, _rules, this}}
+	_resolver{new PkgResolver{_runner, _rules, this}},
+	_completions{new CompletionCache{_runner, _rules, _resolver, this}},
+	_farm{new BuildFarm{_runner, _resolver, this}},
+	_session{new RebuildSession{_runner, _resolver, this}}
 {}
 
 void CliController::parseArguments(const QCoreApplication &app)
@@ -33,10 +40,15 @@ void CliController::run()
 	try {
 		auto args = _parser->positionalArguments();
 		if(_parser->enterContext(QStringLiteral("rebuild"))) {
-			testEmpty(args);
-			rebuild();
-		} else if(_parser->enterContext(QStringLiteral("update")))
-			update(args, _parser->isSet(QStringLiteral("stdin")));
+			auto resume = _parser->isSet(QStringLiteral("resume"));
+			if(resume)
+				testEmpty(args);
+			rebuild(args, resume, _parser->isSet(QStringLiteral("early-cutoff")));
+		} else if(_parser->enterContext(QStringLiteral("update"))) {
+			update(args,
+				   _parser->isSet(QStringLiteral("stdin")),
+				   _parser->value(QStringLiteral("roots")));
+		}
 		else if(_parser->enterContext(QStringLiteral("create"))) {
 			if(args.isEmpty())
 				throw tr("You must specify a package to create a rule for");
@@ -45,11 +57,22 @@ void CliController::run()
 			remove(args);
 		else if(_parser->enterContext(QStringLiteral("list"))) {
 			testEmpty(args);
-			list(_parser->isSet(QStringLiteral("detail")));
+			list(_parser->isSet(QStringLiteral("detail")),
+				 _parser->isSet(QStringLiteral("waves")),
+				 _parser->isSet(QStringLiteral("cached")),
+				 _parser->value(QStringLiteral("roots")));
+		} else if(_parser->enterContext(QStringLiteral("predict"))) {
+			testEmpty(args);
+			predict(_parser->isSet(QStringLiteral("detail")),
+					_parser->isSet(QStringLiteral("waves")));
 		} else if(_parser->enterContext(QStringLiteral("rules"))) {
 			testEmpty(args);
-			listRules(_parser->isSet(QStringLiteral("short")),
-					  _parser->isSet(QStringLiteral("user")));
+			if(_parser->isSet(QStringLiteral("stats")))
+				listRuleStats(_parser->isSet(QStringLiteral("user")));
+			else {
+				listRules(_parser->isSet(QStringLiteral("short")),
+						  _parser->isSet(QStringLiteral("user")));
+			}
 		} else if(_parser->enterContext(QStringLiteral("clear")))
 			clear(args);
 		else if(_parser->enterContext(QStringLiteral("frontend"))) {
@@ -59,8 +82,54 @@ void CliController::run()
 							_parser->isSet(QStringLiteral("waved")));
 			} else if(_parser->isSet(QStringLiteral("reset")))
 				resetFrontend();
+			else if(_parser->isSet(QStringLiteral("prefetch")))
+				setPrefetch(_parser->value(QStringLiteral("prefetch")));
+			else if(_parser->isSet(QStringLiteral("upstream")))
+				setUpstream(_parser->value(QStringLiteral("upstream")));
+			else if(_parser->isSet(QStringLiteral("tune")))
+				setTune(_parser->value(QStringLiteral("tune")));
+			else if(_parser->isSet(QStringLiteral("throttle")))
+				setThrottle(_parser->value(QStringLiteral("throttle")));
+			else if(_parser->isSet(QStringLiteral("batch")))
+				setBatch(_parser->value(QStringLiteral("batch")));
+			else if(_parser->isSet(QStringLiteral("chroot")))
+				setChroot(_parser->value(QStringLiteral("chroot")));
+			else if(_parser->isSet(QStringLiteral("substitute")))
+				setSubstitute(_parser->values(QStringLiteral("substitute")));
 			else
 				frontend();
+		} else if(_parser->enterContext(QStringLiteral("plan"))) {
+			testEmpty(args);
+			plan(_parser->value(QStringLiteral("shards")).toInt(),
+				 _parser->value(QStringLiteral("format")),
+				 _parser->value(QStringLiteral("spool")));
+		} else if(_parser->enterContext(QStringLiteral("worker"))) {
+			testEmpty(args);
+			worker(_parser->value(QStringLiteral("spool")),
+				   _parser->value(QStringLiteral("id")),
+				   _parser->value(QStringLiteral("shard")).toInt(),
+				   _parser->value(QStringLiteral("command")));
+		} else if(_parser->enterContext(QStringLiteral("record"))) {
+			if(args.size() != 1)
+				throw tr("You must specify either on or off");
+			record(args.first());
+		} else if(_parser->enterContext(QStringLiteral("defer"))) {
+			if(args.size() != 1)
+				throw tr("You must specify either on or off");
+			defer(args.first());
+		} else if(_parser->enterContext(QStringLiteral("process"))) {
+			testEmpty(args);
+			process();
+		} else if(_parser->enterContext(QStringLiteral("replay"))) {
+			if(args.size() != 1)
+				throw tr("You must specify exactly one rule directory to replay against");
+			replay(args.first(), _parser->value(QStringLiteral("log")));
+		} else if(_parser->enterContext(QStringLiteral("upstream")))
+			upstream(args);
+		else if(_parser->enterContext(QStringLiteral("completions"))) {
+			if(args.size() != 1)
+				throw tr("You must specify exactly one kind of completions to list");
+			completions(args.first());
 		} else
 			throw QStringLiteral("Invalid arguments");
 		_parser->leaveContext();
@@ -81,7 +150,22 @@ void CliController::setup()
 						   QStringLiteral("Run in verbose mode to output more information.")
 					   });
 
-	_parser->addLeafNode(QStringLiteral("rebuild"), QStringLiteral("Build all packages that need a rebuild."));
+	auto rebuildNode = _parser->addLeafNode(QStringLiteral("rebuild"), QStringLiteral("Build all packages that need a rebuild."));
+	rebuildNode->addPositionalArgument(QStringLiteral("packages"),
+									   QStringLiteral("Only rebuild these packages and the pending packages they depend on. "
+													  "All other packages stay marked for a later rebuild."),
+									   QStringLiteral("[<package> ...]"));
+	rebuildNode->addOption({
+							   QStringLiteral("resume"),
+							   QStringLiteral("Continue the last rebuild session that did not finish. Packages that were already rebuilt are "
+											  "skipped, failed ones and their dependents are tried again.")
+						   });
+	rebuildNode->addOption({
+							   {QStringLiteral("c"), QStringLiteral("early-cutoff")},
+							   QStringLiteral("Compare the files of every rebuilt package with the previously installed ones. If nothing "
+											  "changed, the packages that were only marked because of it are not rebuilt. Requires a "
+											  "waved frontend.")
+						   });
 	_parser->setDefaultNode(QStringLiteral("rebuild"));
 
 	auto updateNode = _parser->addLeafNode(QStringLiteral("update"), QStringLiteral("Mark packages as updated."));
@@ -92,6 +176,11 @@ void CliController::setup()
 							  QStringLiteral("stdin"),
 							  QStringLiteral("Read the packages to be updated from stdin")
 						  });
+	updateNode->addOption({
+							  QStringLiteral("roots"),
+							  QStringLiteral("Instead of the running system, update all alternate roots listed in the given <file>."),
+							  QStringLiteral("file")
+						  });
 
 	auto createNode = _parser->addLeafNode(QStringLiteral("create"), QStringLiteral("Create a rule for a package and it's dependencies."));
 	createNode->addOption({
@@ -113,6 +202,31 @@ void CliController::setup()
 							{QStringLiteral("d"), QStringLiteral("detail")},
 							QStringLiteral("Display a detailed table with all packages and the dependencies that triggered them.")
 						});
+	listNode->addOption({
+							{QStringLiteral("w"), QStringLiteral("waves")},
+							QStringLiteral("Display the packages in the waves they will be rebuilt in, one wave per line.")
+						});
+	listNode->addOption({
+							QStringLiteral("cached"),
+							QStringLiteral("Only list the packages that are already known to be rebuilt, without evaluating the transactions "
+										   "queued by a deferring hook.")
+						});
+	listNode->addOption({
+							QStringLiteral("roots"),
+							QStringLiteral("Instead of the running system, list the packages of all alternate roots listed in the given <file>."),
+							QStringLiteral("file")
+						});
+
+	auto predictNode = _parser->addLeafNode(QStringLiteral("predict"), QStringLiteral("List all packages that would need to be rebuilt after upgrading "
+																						 "to the versions of the current sync databases."));
+	predictNode->addOption({
+							   {QStringLiteral("d"), QStringLiteral("detail")},
+							   QStringLiteral("Display a detailed table with all packages and the dependencies that would trigger them.")
+						   });
+	predictNode->addOption({
+							   {QStringLiteral("w"), QStringLiteral("waves")},
+							   QStringLiteral("Display the packages in the waves they would be rebuilt in, one wave per line.")
+						   });
 
 	auto rulesNode = _parser->addLeafNode(QStringLiteral("rules"), QStringLiteral("List all rules known to repkg"));
 	rulesNode->addOption({
@@ -123,6 +237,11 @@ void CliController::setup()
 							 {QStringLiteral("u"), QStringLiteral("user")},
 							 QStringLiteral("Only display rules the belong to the currently executing user.")
 						 });
+	rulesNode->addOption({
+							 QStringLiteral("stats"),
+							 QStringLiteral("Display how often each rule was evaluated, triggered and skipped by it's filter, how many "
+											"packages wildcard rules apply to and how much build time they caused, most expensive first.")
+						 });
 
 
 	auto clearNode = _parser->addLeafNode(QStringLiteral("clear"),
@@ -146,14 +265,156 @@ void CliController::setup()
 								{QStringLiteral("r"), QStringLiteral("reset")},
 								QStringLiteral("Reset the frontend, so that repkg can automatically find the default to be used with correct parameters")
 							});
+	frontendNode->addOption({
+								{QStringLiteral("p"), QStringLiteral("prefetch")},
+								QStringLiteral("Mirror the build repositories from <remote> and prefetch the package sources while earlier packages "
+											   "are built. '%1' in <remote> is replaced by the pkgbase, e.g. https://aur.archlinux.org/%1.git. "
+											   "Pass an empty string to disable prefetching again."),
+								QStringLiteral("remote")
+							});
+	frontendNode->addOption({
+								QStringLiteral("upstream"),
+								QStringLiteral("Check pending rebuilds for newer upstream versions, which are then built instead. <source> is "
+											   "either an AUR RPC url (e.g. https://aur.archlinux.org/rpc) or a local json file with the "
+											   "same package infos. Pass an empty string to disable the checks."),
+								QStringLiteral("source")
+							});
+	frontendNode->addOption({
+								QStringLiteral("tune"),
+								QStringLiteral("Enable (on) or disable (off) tuned build environments: builds happen in a tmpfs if their "
+											   "last build fits into the free memory, MAKEFLAGS uses all idle cores and packages are not "
+											   "compressed, as they are only installed locally."),
+								QStringLiteral("on|off")
+							});
+	frontendNode->addOption({
+								QStringLiteral("throttle"),
+								QStringLiteral("Run builds with the lowest CPU and IO priority, and only start them while the machine is below "
+											   "the given <limits>, a comma seperated list of load=<load average>, memory=<MiB that must "
+											   "stay available> and pressure=<percent of stalled time>. Running builds are paused while "
+											   "the pressure limit is exceeded. Pass an empty string to disable throttling."),
+								QStringLiteral("limits")
+							});
+	frontendNode->addOption({
+								QStringLiteral("batch"),
+								QStringLiteral("Instead of calling the frontend, build the packages with makepkg in the prefetched repositories "
+											   "(see '--prefetch') into <pkgdest>, and install all packages of a wave with a single pacman "
+											   "transaction. Pass an empty string to use the frontend again."),
+								QStringLiteral("pkgdest")
+							});
+	frontendNode->addOption({
+								QStringLiteral("chroot"),
+								QStringLiteral("Combine with '--batch'. Build every package in a copy-on-write snapshot of a clean root kept "
+											   "in <directory>, with only it's build dependencies installed from the local package cache. "
+											   "Pass an empty string to build on the host again."),
+								QStringLiteral("directory")
+							});
+	frontendNode->addOption({
+								QStringLiteral("substitute"),
+								QStringLiteral("Before building a package, look for a newer binary of it in the local <repository> database "
+											   "(a path or file:// url to the .db file) that was built after the packages that triggered the "
+											   "rebuild, and install that one instead. Can be given multiple times. Pass an empty string to "
+											   "disable substitution again."),
+								QStringLiteral("repository")
+							});
+
+	auto planNode = _parser->addLeafNode(QStringLiteral("plan"), QStringLiteral("Split the pending rebuilds into shards for multiple builder machines."));
+	planNode->addOption({
+							{QStringLiteral("n"), QStringLiteral("shards")},
+							QStringLiteral("The number of <shards> to split the packages into. Every wave is balanced across them, only split packages always stay in the same shard."),
+							QStringLiteral("shards"),
+							QStringLiteral("1")
+						});
+	planNode->addOption({
+							{QStringLiteral("f"), QStringLiteral("format")},
+							QStringLiteral("The output <format> of the plan. Can be either text or json."),
+							QStringLiteral("format"),
+							QStringLiteral("text")
+						});
+	planNode->addOption({
+							QStringLiteral("spool"),
+							QStringLiteral("Queue the planned packages in the spool <directory>, so that workers can claim and build them."),
+							QStringLiteral("directory")
+						});
+
+	auto workerNode = _parser->addLeafNode(QStringLiteral("worker"), QStringLiteral("Claim and build packages from a spool directory, until none are left."));
+	workerNode->addOption({
+							  QStringLiteral("spool"),
+							  QStringLiteral("The spool <directory> created via 'repkg plan --spool'."),
+							  QStringLiteral("directory")
+						  });
+	workerNode->addOption({
+							  QStringLiteral("command"),
+							  QStringLiteral("The build <command> to run for each package. The package name is appended and built packages "
+											 "must be placed into $PKGDEST."),
+							  QStringLiteral("command")
+						  });
+	workerNode->addOption({
+							  QStringLiteral("id"),
+							  QStringLiteral("The <name> of the worker, as recorded in the spool. Defaults to <hostname>-<pid>."),
+							  QStringLiteral("name")
+						  });
+	workerNode->addOption({
+							  QStringLiteral("shard"),
+							  QStringLiteral("The <shard> this worker prefers. Packages of other shards are only built when there is nothing left "
+											 "to do for the own shard."),
+							  QStringLiteral("shard"),
+							  QStringLiteral("-1")
+						  });
+
+	auto recordNode = _parser->addLeafNode(QStringLiteral("record"),
+										   QStringLiteral("Enable or disable recording all transactions seen by the pacman hook, for 'repkg replay'."));
+	recordNode->addPositionalArgument(QStringLiteral("mode"),
+									  QStringLiteral("Either on or off."),
+									  QStringLiteral("on|off"));
+
+	auto deferNode = _parser->addLeafNode(QStringLiteral("defer"),
+										  QStringLiteral("Enable or disable deferred evaluation: the pacman hook only queues the updated packages, "
+														 "which are evaluated by the next 'repkg list', 'repkg rebuild' or 'repkg process'."));
+	deferNode->addPositionalArgument(QStringLiteral("mode"),
+									 QStringLiteral("Either on or off."),
+									 QStringLiteral("on|off"));
+
+	_parser->addLeafNode(QStringLiteral("process"),
+						 QStringLiteral("Evaluate all transactions queued by a deferring hook and store the results."));
+
+	auto replayNode = _parser->addLeafNode(QStringLiteral("replay"),
+										   QStringLiteral("Replay the recorded transactions against the current rules and the ones of a candidate "
+														  "rule directory, and compare how often each package would have been rebuilt."));
+	replayNode->addPositionalArgument(QStringLiteral("rules"),
+									  QStringLiteral("The directory containing the candidate rule files."),
+									  QStringLiteral("<rule-directory>"));
+	replayNode->addOption({
+							  QStringLiteral("log"),
+							  QStringLiteral("The transaction log <file> to replay. Defaults to the one recorded by the hook."),
+							  QStringLiteral("file")
+						  });
+
+	auto upstreamNode = _parser->addLeafNode(QStringLiteral("upstream"),
+											 QStringLiteral("List the packages with a newer version in the configured upstream source."));
+	upstreamNode->addPositionalArgument(QStringLiteral("packages"),
+										QStringLiteral("The installed packages to check. If none are specified, all packages marked "
+													   "for a rebuild are checked."),
+										QStringLiteral("[<package> ...]"));
+
+	auto completionsNode = _parser->addLeafNode(QStringLiteral("completions"),
+												QStringLiteral("List cached completion candidates for the shell completion scripts."));
+	completionsNode->addPositionalArgument(QStringLiteral("kind"),
+										   QStringLiteral("The kind of candidates to list. Can be one of: installed, pending, rules"));
 }
 
-void CliController::rebuild()
+void CliController::rebuild(const QStringList &pkgs, bool resume, bool earlyCutoff)
 {
-	qApp->exit(_runner->run(_resolver->listPkgWaves()));
+	if(resume)
+		qApp->exit(_session->resume());
+	else {
+		if(earlyCutoff && !std::get<1>(_runner->frontend()))
+			qWarning() << "Early cutoff is only possible with a waved frontend, all packages are rebuilt";
+		processQueue();
+		qApp->exit(_session->run(_resolver->listPkgWaves(pkgs), earlyCutoff));
+	}
 }
 
-void CliController::update(QStringList pkgs, bool fromStdin)
+void CliController::update(QStringList pkgs, bool fromStdin, const QString &rootsFile)
 {
 	if(fromStdin) {
 		if(!pkgs.isEmpty())
@@ -162,13 +423,29 @@ void CliController::update(QStringList pkgs, bool fromStdin)
 		in.open(stdin, QIODevice::ReadOnly);
 		pkgs = QString::fromUtf8(in.readAll().simplified()).split(QLatin1Char(' '), QString::SkipEmptyParts);
 	}
-	_resolver->updatePkgs(pkgs);
+	if(rootsFile.isEmpty()) {
+		if(_resolver->isDeferred())
+			_resolver->enqueuePkgs(pkgs);
+		else {
+			_resolver->updatePkgs(pkgs);
+			_completions->updatePending();
+		}
+	} else {
+		runRoots(rootsFile, [pkgs](PacmanRunner *, RuleController *, PkgResolver *resolver) {
+			if(resolver->isDeferred())
+				resolver->enqueuePkgs(pkgs);
+			else
+				resolver->updatePkgs(pkgs);
+			return QString{};
+		});
+	}
 	qApp->quit();
 }
 
 void CliController::create(const QString &pkg, bool autoDepends, const QStringList &rules)
 {
 	_rules->createRule(pkg, autoDepends, rules);
+	_completions->updateRules();
 	qApp->quit();
 }
 
@@ -176,37 +453,115 @@ void CliController::remove(const QStringList &pkgs)
 {
 	for(const auto &pkg : pkgs)
 		_rules->removeRule(pkg);
+	_completions->updateRules();
 	qInfo() << "Remember to run `sudo repkg update <pkgs>` to remove any already scheduled rebuilds";
 	qApp->quit();
 }
 
-void CliController::list(bool detail)
+void CliController::list(bool detail, bool waves, bool cached, const QString &rootsFile)
 {
-	if(detail)
-		qInfo().noquote() << _resolver->listDetailPkgs();
-	else {
-		auto list = _resolver->listPkgs();
-		if(!list.isEmpty())
-			qInfo().noquote() << list.join(QStringLiteral(" "));
+	if(rootsFile.isEmpty()) {
+		// root stores the evaluated queue right away, everyone else evaluates it in memory when listing
+		if(!cached && global::isRoot())
+			_resolver->processQueue();
+		auto output = listOutput(_runner, _resolver, cached ? _resolver->listEvaluatedPkgInfos() : _resolver->listPkgInfos(), detail, waves);
+		if(!output.isEmpty())
+			qInfo().noquote() << output;
+	} else {
+		runRoots(rootsFile, [detail, waves, cached](PacmanRunner *runner, RuleController *, PkgResolver *resolver) {
+			return listOutput(runner, resolver, cached ? resolver->listEvaluatedPkgInfos() : resolver->listPkgInfos(), detail, waves);
+		});
 	}
 	qApp->quit();
 }
 
+void CliController::predict(bool detail, bool waves)
+{
+	auto output = listOutput(_runner, _resolver, _resolver->predictPkgs(), detail, waves);
+	if(!output.isEmpty())
+		qInfo().noquote() << output;
+	qApp->quit();
+}
+
 void CliController::listRules(bool listShort, bool userOnly)
 {
 	qInfo().noquote() << _rules->listRules(listShort, userOnly);
 	qApp->quit();
 }
 
+void CliController::listRuleStats(bool userOnly)
+{
+	struct Row {
+		QString rule;
+		PkgResolver::RuleStats stats;
+		int fanOut;
+		qint64 cost;
+	};
+
+	const auto stats = _resolver->readRuleStats();
+	const auto fanOut = _rules->wildcardFanOut();
+	const auto costs = RebuildSession::readRuleCosts();
+	QVector<Row> rows;
+	for(const auto &rule : _rules->listRuleNames(userOnly))
+		rows.append(Row{rule, stats.value(rule), fanOut.value(rule, 1), costs.value(rule)});
+	std::sort(rows.begin(), rows.end(), [](const Row &lhs, const Row &rhs) {
+		if(lhs.cost != rhs.cost)
+			return lhs.cost > rhs.cost;
+		else if(lhs.stats.triggers != rhs.stats.triggers)
+			return lhs.stats.triggers > rhs.stats.triggers;
+		else
+			return lhs.rule < rhs.rule;
+	});
+
+	const auto formatTime = [](qint64 msecs) {
+		const auto secs = msecs / 1000;
+		return QStringLiteral("%1:%2:%3")
+				.arg(secs / 3600)
+				.arg((secs / 60) % 60, 2, 10, QLatin1Char('0'))
+				.arg(secs % 60, 2, 10, QLatin1Char('0'));
+	};
+	QStringList lines;
+	lines.append(QStringLiteral("%1| Evaluated | Triggered | Skipped | Fan-out | Build time").arg(QStringLiteral(" Rule"), -30));
+	lines.append(QStringLiteral("-").repeated(30) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(11) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(11) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(9) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(9) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(11));
+	for(const auto &row : qAsConst(rows)) {
+		lines.append(QStringLiteral(" %1| %2 | %3 | %4 | %5 | %6")
+					 .arg(row.rule, -29)
+					 .arg(row.stats.evaluations, 9)
+					 .arg(row.stats.triggers, 9)
+					 .arg(row.stats.skips, 7)
+					 .arg(row.fanOut, 7)
+					 .arg(formatTime(row.cost), 10));
+	}
+	qInfo().noquote() << lines.join(QLatin1Char('\n'));
+	qApp->quit();
+}
+
 void CliController::clear(const QStringList &pkgs)
 {
 	_resolver->clear(pkgs);
+	_completions->updatePending();
 	qApp->quit();
 }
 
 void CliController::frontend()
 {
 	qInfo().noquote() << _runner->frontendDescription();
+	AdmissionControl admission;
+	if(admission.isEnabled())
+		qInfo().noquote() << "Throttling builds with limits:" << admission.limitsDescription();
+	if(BuildProfile::isEnabled())
+		qInfo().noquote() << "Using tuned build environments";
+	const auto upstream = UpstreamSource::source();
+	if(!upstream.isEmpty())
+		qInfo().noquote() << "Checking for upstream updates via:" << upstream;
+	const auto chroot = ChrootBuilder::directory();
+	if(!chroot.isEmpty())
+		qInfo().noquote() << "Building in clean chroot snapshots of:" << chroot;
 	qApp->quit();
 }
 
@@ -222,8 +577,273 @@ void CliController::resetFrontend()
 	qApp->quit();
 }
 
+void CliController::plan(int shards, const QString &format, const QString &spoolDir)
+{
+	const auto asJson = format == QStringLiteral("json");
+	if(!asJson && format != QStringLiteral("text"))
+		throw QStringLiteral("Unknown plan format: %1").arg(format);
+
+	const auto plan = _farm->createPlan(shards);
+	if(!spoolDir.isEmpty())
+		_farm->writeSpool(spoolDir, plan, shards);
+
+	if(asJson)
+		qInfo().noquote() << QString::fromUtf8(BuildFarm::planToJson(plan, shards).toJson(QJsonDocument::Indented)).trimmed();
+	else
+		qInfo().noquote() << BuildFarm::planToText(plan, shards);
+	qApp->quit();
+}
+
+void CliController::worker(const QString &spoolDir, const QString &workerId, int shard, const QString &command)
+{
+	if(spoolDir.isEmpty())
+		throw QStringLiteral("You must specify the spool directory to claim packages from");
+	auto id = workerId;
+	if(id.isEmpty())
+		id = QStringLiteral("%1-%2").arg(QSysInfo::machineHostName()).arg(QCoreApplication::applicationPid());
+	qApp->exit(_farm->runWorker(spoolDir, id, shard, command.split(QLatin1Char(' '), QString::SkipEmptyParts)));
+}
+
+void CliController::record(const QString &mode)
+{
+	if(mode == QStringLiteral("on"))
+		_resolver->setRecording(true);
+	else if(mode == QStringLiteral("off"))
+		_resolver->setRecording(false);
+	else
+		throw QStringLiteral("Invalid record mode \"%1\" - must be on or off").arg(mode);
+	qApp->quit();
+}
+
+void CliController::defer(const QString &mode)
+{
+	if(mode == QStringLiteral("on"))
+		_resolver->setDeferred(true);
+	else if(mode == QStringLiteral("off"))
+		_resolver->setDeferred(false);
+	else
+		throw QStringLiteral("Invalid defer mode \"%1\" - must be on or off").arg(mode);
+	_completions->updatePending();
+	qApp->quit();
+}
+
+void CliController::processQueue()
+{
+	// the session reads the pending packages many times, so the queue is evaluated and stored once up front
+	if(!_resolver->hasQueue())
+		return;
+	if(global::isRoot())
+		_resolver->processQueue();
+	else {
+		const auto sudo = QStandardPaths::findExecutable(QStringLiteral("sudo"));
+		if(sudo.isNull())
+			throw QStringLiteral("Unable to find sudo binary in PATH");
+		if(QProcess::execute(sudo, {QCoreApplication::applicationFilePath(), QStringLiteral("process")}) != EXIT_SUCCESS)
+			throw QStringLiteral("Failed to evaluate the queued transactions");
+		_resolver->reload();
+	}
+}
+
+void CliController::process()
+{
+	const auto count = _resolver->processQueue();
+	qDebug() << "Evaluated" << count << "queued transactions";
+	_completions->updatePending();
+	qApp->quit();
+}
+
+void CliController::replay(const QString &ruleDir, const QString &logFile)
+{
+	if(!QDir{ruleDir}.exists())
+		throw QStringLiteral("Rule directory %1 does not exist").arg(ruleDir);
+
+	QElapsedTimer timer;
+	timer.start();
+	QVector<transactionlog::Transaction> transactions;
+	transactionlog::read(logFile.isEmpty() ? _resolver->transactionLog() : logFile,
+						 [&transactions](const transactionlog::Transaction &transaction) {
+		transactions.append(transaction);
+	});
+	if(transactions.isEmpty())
+		throw QStringLiteral("The transaction log does not contain any transactions");
+
+	// evaluate both rule sets, without touching the real state
+	auto candidateRoot = global::hostRoot();
+	candidateRoot.rulePaths = {{QDir{ruleDir}, true}};
+	RuleController candidateRules{candidateRoot, _runner};
+	PkgResolver candidateResolver{candidateRoot, _runner, &candidateRules};
+	const auto current = _resolver->replay(transactions);
+	const auto candidate = candidateResolver.replay(transactions);
+	qDebug() << "Replayed" << transactions.size() << "transactions in" << timer.elapsed() << "ms";
+
+	auto pkgs = QSet<QString>::fromList(current.keys() + candidate.keys()).toList();
+	std::sort(pkgs.begin(), pkgs.end());
+	QStringList lines;
+	lines.append(QStringLiteral("Replayed %1 transactions from %2 to %3")
+				 .arg(transactions.size())
+				 .arg(transactions.first().time.toLocalTime().toString(Qt::ISODate),
+					  transactions.last().time.toLocalTime().toString(Qt::ISODate)));
+	lines.append(QStringLiteral("%1| Current | Candidate | Difference").arg(QStringLiteral(" Package"), -30));
+	lines.append(QStringLiteral("-").repeated(30) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(9) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(11) + QLatin1Char('|') +
+				 QStringLiteral("-").repeated(11));
+	const auto formatDiff = [](int diff) {
+		return diff > 0 ? QStringLiteral("+%1").arg(diff) : QString::number(diff);
+	};
+	auto currentSum = 0;
+	auto candidateSum = 0;
+	for(const auto &pkg : qAsConst(pkgs)) {
+		const auto currentCount = current.value(pkg);
+		const auto candidateCount = candidate.value(pkg);
+		currentSum += currentCount;
+		candidateSum += candidateCount;
+		lines.append(QStringLiteral("%1| %2 | %3 | %4")
+					 .arg(pkg, -30)
+					 .arg(currentCount, 7)
+					 .arg(candidateCount, 9)
+					 .arg(formatDiff(candidateCount - currentCount), 10));
+	}
+	lines.append(QStringLiteral("%1| %2 | %3 | %4")
+				 .arg(QStringLiteral(" Total"), -30)
+				 .arg(currentSum, 7)
+				 .arg(candidateSum, 9)
+				 .arg(formatDiff(candidateSum - currentSum), 10));
+	qInfo().noquote() << lines.join(QLatin1Char('\n'));
+	qApp->quit();
+}
+
+void CliController::setPrefetch(const QString &remote)
+{
+	_runner->setPrefetchRemote(remote);
+	qApp->quit();
+}
+
+void CliController::upstream(QStringList pkgs)
+{
+	if(UpstreamSource::source().isEmpty())
+		throw QStringLiteral("No upstream source configured. Use 'repkg frontend --upstream' to set one");
+	if(pkgs.isEmpty())
+		pkgs = _resolver->listPkgs();
+
+	const auto updates = UpstreamSource{_runner}.readUpdates(pkgs);
+	auto updatedPkgs = updates.keys();
+	std::sort(updatedPkgs.begin(), updatedPkgs.end());
+	for(const auto &pkg : qAsConst(updatedPkgs)) {
+		qInfo().noquote() << pkg
+						  << _runner->readLocalVersion(pkg)
+						  << "->"
+						  << updates.value(pkg);
+	}
+	qApp->quit();
+}
+
+void CliController::setUpstream(const QString &source)
+{
+	UpstreamSource::setSource(source);
+	qApp->quit();
+}
+
+void CliController::setTune(const QString &mode)
+{
+	if(mode == QStringLiteral("on"))
+		BuildProfile::setEnabled(true);
+	else if(mode == QStringLiteral("off"))
+		BuildProfile::setEnabled(false);
+	else
+		throw QStringLiteral("Invalid tune mode \"%1\" - must be on or off").arg(mode);
+	qApp->quit();
+}
+
+void CliController::setThrottle(const QString &limits)
+{
+	AdmissionControl{}.setLimits(limits);
+	qApp->quit();
+}
+
+void CliController::setBatch(const QString &pkgDest)
+{
+	_runner->setBatchDestination(pkgDest);
+	qApp->quit();
+}
+
+void CliController::setChroot(const QString &directory)
+{
+	ChrootBuilder::setDirectory(directory);
+	qApp->quit();
+}
+
+void CliController::setSubstitute(const QStringList &repositories)
+{
+	QStringList repos;
+	for(const auto &repo : repositories) {
+		if(!repo.isEmpty())
+			repos.append(repo);
+	}
+	_runner->setSubstituteRepositories(repos);
+	qApp->quit();
+}
+
+void CliController::completions(const QString &kind)
+{
+	CompletionCache::Kind cKind;
+	if(kind == QStringLiteral("installed"))
+		cKind = CompletionCache::Kind::Installed;
+	else if(kind == QStringLiteral("pending"))
+		cKind = CompletionCache::Kind::Pending;
+	else if(kind == QStringLiteral("rules"))
+		cKind = CompletionCache::Kind::Rules;
+	else
+		throw QStringLiteral("Unknown completion kind: %1").arg(kind);
+
+	auto list = _completions->read(cKind);
+	if(!list.isEmpty())
+		qInfo().noquote() << list.join(QLatin1Char(' '));
+	qApp->quit();
+}
+
 void CliController::testEmpty(const QStringList &args)
 {
 	if(!args.isEmpty())
 		throw QStringLiteral("Unexpected arguments after command!");
 }
+
+void CliController::runRoots(const QString &rootsFile, const RootPool::Task &task)
+{
+	RootPool pool{global::readRoots(rootsFile)};
+	auto failed = false;
+	for(const auto &result : pool.run(task)) {
+		if(!result.error.isNull()) {
+			qCritical().noquote() << QStringLiteral("[%1]").arg(result.name) << result.error;
+			failed = true;
+		} else if(result.output.contains(QLatin1Char('\n')))
+			qInfo().noquote() << QStringLiteral("[%1]\n%2").arg(result.name, result.output);
+		else if(!result.output.isEmpty())
+			qInfo().noquote() << QStringLiteral("[%1]").arg(result.name) << result.output;
+	}
+	if(failed)
+		throw QStringLiteral("Failed to process some of the roots in %1").arg(rootsFile);
+}
+
+QString CliController::listOutput(PacmanRunner *runner, PkgResolver *resolver, const PkgResolver::PkgInfos &pkgInfos, bool detail, bool waves)
+{
+	if(detail) {
+		// the upstream versions are only informational, so listing must also work offline
+		QHash<QString, QString> upstreamUpdates;
+		try {
+			upstreamUpdates = UpstreamSource{runner}.readUpdates(pkgInfos.keys());
+		} catch(QString &e) {
+			qWarning().noquote() << "Unable to check for upstream updates:" << e;
+		}
+		return PkgResolver::formatDetail(pkgInfos,
+										 resolver->readPkgBases(pkgInfos.keys()),
+										 upstreamUpdates);
+	}
+	else if(waves) {
+		QStringList lines;
+		for(const auto &wave : PkgResolver::calcWaves(pkgInfos, resolver->readPkgBases(pkgInfos.keys())))
+			lines.append(wave.join(QLatin1Char(' ')));
+		return lines.join(QLatin1Char('\n'));
+	} else
+		return pkgInfos.keys().join(QLatin1Char(' '));
+}
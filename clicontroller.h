@@ -4,6 +4,11 @@
 #include "pkgresolver.h"
 #include "rulecontroller.h"
 #include "pacmanrunner.h"
+#include "completioncache.h"
+#include "rootpool.h"
+#include "buildfarm.h"
+#include "rebuildsession.h"
+#include "upstreamsource.h"
 
 #include <QCoreApplication>
 #include <QObject>
@@ -25,24 +30,47 @@ private slots:
 private:
 	void setup();
 
-	void rebuild();
-	void update(QStringList pkgs, bool fromStdin);
+	void rebuild(const QStringList &pkgs, bool resume, bool earlyCutoff);
+	void update(QStringList pkgs, bool fromStdin, const QString &rootsFile);
 	void create(const QString &pkg, bool autoDepends, const QStringList &rules);
 	void remove(const QStringList &pkgs);
-	void list(bool detail);
+	void list(bool detail, bool waves, bool cached, const QString &rootsFile);
+	void predict(bool detail, bool waves);
 	void listRules(bool listShort, bool userOnly);
+	void listRuleStats(bool userOnly);
 	void clear(const QStringList &pkgs);
 	void frontend();
 	void setFrontend(const QStringList &frontend, bool waved);
 	void resetFrontend();
+	void setPrefetch(const QString &remote);
+	void setUpstream(const QString &source);
+	void setTune(const QString &mode);
+	void setThrottle(const QString &limits);
+	void setBatch(const QString &pkgDest);
+	void setChroot(const QString &directory);
+	void setSubstitute(const QStringList &repositories);
+	void completions(const QString &kind);
+	void plan(int shards, const QString &format, const QString &spoolDir);
+	void worker(const QString &spoolDir, const QString &workerId, int shard, const QString &command);
+	void record(const QString &mode);
+	void defer(const QString &mode);
+	void process();
+	void replay(const QString &ruleDir, const QString &logFile);
+	void upstream(QStringList pkgs);
 
 	void testEmpty(const QStringList &args);
+	void processQueue();
+	void runRoots(const QString &rootsFile, const RootPool::Task &task);
+	static QString listOutput(PacmanRunner *runner, PkgResolver *resolver, const PkgResolver::PkgInfos &pkgInfos, bool detail, bool waves);
 
 	QScopedPointer<QCliParser> _parser;
 
 	PacmanRunner *_runner;
 	RuleController *_rules;
 	PkgResolver *_resolver;
+	CompletionCache *_completions;
+	BuildFarm *_farm;
+	RebuildSession *_session;
 
 	static bool _verbose;
 };
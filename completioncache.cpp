@@ -0,0 +1,99 @@
+#include "completioncache.h"
+#include "global.h"
+
+#include <QDebug>
+#include <QFileInfo>
+using namespace global;
+
+CompletionCache::CompletionCache(PacmanRunner *runner, RuleController *rules, PkgResolver *resolver, QObject *parent) :
+	QObject{parent},
+	_runner{runner},
+	_rules{rules},
+	_resolver{resolver},
+	_systemCache{new QSettings{
+		rootPath().absoluteFilePath(QStringLiteral("../completions.conf")),
+		QSettings::IniFormat,
+		this
+	}},
+	_userCache{new QSettings{
+		userPath().absoluteFilePath(QStringLiteral("../completions.conf")),
+		QSettings::IniFormat,
+		this
+	}}
+{}
+
+QStringList CompletionCache::read(CompletionCache::Kind kind)
+{
+	switch (kind) {
+	case Kind::Installed:
+	{
+		// the local database directory changes with every transaction, so it's mtime is enough to detect stale caches
+		const auto stamp = QString::number(_runner->localDbModified().toMSecsSinceEpoch());
+		if(_systemCache->value(QStringLiteral("installed/stamp")).toString() == stamp)
+			return _systemCache->value(QStringLiteral("installed")).toStringList();
+		auto pkgs = _runner->readInstalledPackages();
+		write(_systemCache, QStringLiteral("installed"), pkgs, stamp);
+		return pkgs;
+	}
+	case Kind::Pending:
+		if(_systemCache->contains(QStringLiteral("pending")))
+			return _systemCache->value(QStringLiteral("pending")).toStringList();
+		else
+			return _resolver->listPkgs();
+	case Kind::Rules:
+	{
+		// rule files can be added without repkg (e.g. by packages), so check the directories as well
+		auto cache = ownCache();
+		if(cache->value(QStringLiteral("rules/stamp")).toString() == rulesStamp())
+			return cache->value(QStringLiteral("rules")).toStringList();
+		auto rules = _rules->listRuleNames(true);
+		write(cache, QStringLiteral("rules"), rules, rulesStamp());
+		return rules;
+	}
+	default:
+		Q_UNREACHABLE();
+		return {};
+	}
+}
+
+void CompletionCache::updatePending()
+{
+	write(_systemCache, QStringLiteral("pending"), _resolver->listPkgs());
+}
+
+void CompletionCache::updateRules()
+{
+	write(ownCache(), QStringLiteral("rules"), _rules->listRuleNames(true), rulesStamp());
+}
+
+QSettings *CompletionCache::ownCache() const
+{
+	return isRoot() ? _systemCache : _userCache;
+}
+
+QString CompletionCache::rulesStamp() const
+{
+	QList<QDir> dirs;
+	if(isRoot())
+		dirs = {rootPath(), systemPath()};
+	else
+		dirs = {userPath()};
+
+	QStringList stamps;
+	for(const auto &dir : dirs)
+		stamps.append(QString::number(QFileInfo{dir.absolutePath()}.lastModified().toMSecsSinceEpoch()));
+	return stamps.join(QLatin1Char(':'));
+}
+
+void CompletionCache::write(QSettings *cache, const QString &key, const QStringList &values, const QString &stamp)
+{
+	if(!cache->isWritable()) {
+		qDebug() << "Skipping completion cache update, cache file is not writable:" << cache->fileName();
+		return;
+	}
+
+	cache->setValue(key, values);
+	if(!stamp.isNull())
+		cache->setValue(key + QStringLiteral("/stamp"), stamp);
+	cache->sync();
+}
@@ -0,0 +1,42 @@
+#ifndef COMPLETIONCACHE_H
+#define COMPLETIONCACHE_H
+
+#include "pacmanrunner.h"
+#include "rulecontroller.h"
+#include "pkgresolver.h"
+
+#include <QObject>
+#include <QSettings>
+
+class CompletionCache : public QObject
+{
+	Q_OBJECT
+
+public:
+	enum class Kind {
+		Installed,
+		Pending,
+		Rules
+	};
+	Q_ENUM(Kind)
+
+	explicit CompletionCache(PacmanRunner *runner, RuleController *rules, PkgResolver *resolver, QObject *parent = nullptr);
+
+	QStringList read(Kind kind);
+
+	void updatePending();
+	void updateRules();
+
+private:
+	PacmanRunner *_runner;
+	RuleController *_rules;
+	PkgResolver *_resolver;
+	QSettings *_systemCache;
+	QSettings *_userCache;
+
+	QSettings *ownCache() const;
+	QString rulesStamp() const;
+	void write(QSettings *cache, const QString &key, const QStringList &values, const QString &stamp = {});
+};
+
+#endif // COMPLETIONCACHE_H
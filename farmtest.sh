@@ -0,0 +1,70 @@
+#!/bin/sh
+# Runs the build farm worker protocol on a single machine, with several local workers
+# building a small fake plan. Two workers are killed while building, one of them with a
+# package that nothing depends on, to check that the other workers take over their
+# abandoned claims instead of exiting.
+# Usage: farmtest.sh [<repkg binary>] [<number of workers, at least 3>]
+set -e
+
+repkg=${1:-repkg}
+workers=${2:-3}
+if [ "$workers" -lt 3 ]; then
+	echo "At least 3 workers are needed, as two of them are killed" >&2
+	exit 1
+fi
+spool=$(mktemp -d)
+trap 'rm -rf "$spool"' EXIT
+
+# name shard [after...]
+task() {
+	name=$1
+	shard=$2
+	shift 2
+	after=
+	for dep in "$@"; do
+		after="$after${after:+,}\"$dep\""
+	done
+	printf '{"name":"%s","triggers":[%s],"after":[%s],"cost":1,"wave":0,"shard":%s}' \
+		"$name" "$after" "$after" "$shard" > "$spool/queue/$name.json"
+}
+
+mkdir -p "$spool/queue"
+echo '{}' > "$spool/plan.json"
+task base 0
+task left 0 base
+task right 1 base
+task top 0 left right
+task crash 1 base
+task leaf 1 crash
+task lone 0
+pkgs="base left right top crash leaf lone"
+
+cat > "$spool/build.sh" <<'EOF'
+#!/bin/sh
+# the first builds of "crash" and "lone" take their worker down and leave the claim behind
+if { [ "$1" = crash ] || [ "$1" = lone ]; } && mkdir "$REPKG_SPOOL/crashed-$1" 2> /dev/null; then
+	kill -9 "$PPID"
+	exit 1
+fi
+sleep 1
+touch "$PKGDEST/$1-1-1-any.pkg.tar"
+EOF
+chmod +x "$spool/build.sh"
+
+i=0
+while [ "$i" -lt "$workers" ]; do
+	"$repkg" worker --spool "$spool" --id "local-$i" --shard "$((i % 2))" --command "$spool/build.sh" &
+	i=$((i + 1))
+done
+wait
+
+result=0
+for pkg in $pkgs; do
+	if [ -f "$spool/done/$pkg.json" ] && [ -f "$spool/artifacts/$pkg/$pkg-1-1-any.pkg.tar" ]; then
+		echo "ok:      $pkg"
+	else
+		echo "missing: $pkg"
+		result=1
+	fi
+done
+exit $result
@@ -1,6 +1,9 @@
 #include "global.h"
 #include <QCoreApplication>
 #include <QStandardPaths>
+#include <QSettings>
+#include <QFile>
+#include <pwd.h>
 #include <unistd.h>
 
 bool global::isRoot()
@@ -8,7 +11,7 @@ bool global::isRoot()
 	return ::geteuid() == 0;
 }
 
-QDir global::userPath()
+QString global::userName()
 {
 	QByteArray user;
 
@@ -20,9 +23,13 @@ QDir global::userPath()
 		if(user.isEmpty())
 			user = qgetenv("USER");
 	}
+	return QString::fromUtf8(user);
+}
 
+QDir global::userPath()
+{
 	QDir dir = QStringLiteral("/home/%1/.config/%2/rules")
-			   .arg(QString::fromUtf8(user), QCoreApplication::applicationName());
+			   .arg(userName(), QCoreApplication::applicationName());
 	dir.mkpath(QStringLiteral("."));
 	if(dir.exists())
 		return dir;
@@ -30,6 +37,23 @@ QDir global::userPath()
 		return {};
 }
 
+QList<std::pair<QString, QDir>> global::userRulePaths()
+{
+	// only real users can have rules, system accounts are skipped
+	QList<std::pair<QString, QDir>> paths;
+	::setpwent();
+	while(const auto entry = ::getpwent()) {
+		if(entry->pw_uid < 1000 || entry->pw_uid >= 60000)
+			continue;
+		QDir dir = QStringLiteral("%1/.config/%2/rules")
+				   .arg(QFile::decodeName(entry->pw_dir), QCoreApplication::applicationName());
+		if(dir.exists())
+			paths.append(std::make_pair(QString::fromUtf8(entry->pw_name), dir));
+	}
+	::endpwent();
+	return paths;
+}
+
 QDir global::rootPath()
 {
 	QDir dir = QStringLiteral("/etc/%1/rules")
@@ -50,3 +74,64 @@ QDir global::systemPath()
 	else
 		return {};
 }
+
+global::RootConfig global::hostRoot()
+{
+	RootConfig root;
+	root.name = QStringLiteral("host");
+	root.rulePaths = {
+		{userPath(), false},
+		{rootPath(), true},
+		{systemPath(), true},
+	};
+	root.stateFile = rootPath().absoluteFilePath(QStringLiteral("../state.conf"));
+	return root;
+}
+
+QList<global::RootConfig> global::readRoots(const QString &configFile)
+{
+	if(!QFile::exists(configFile))
+		throw QStringLiteral("Roots configuration file %1 does not exist").arg(configFile);
+
+	QSettings settings{configFile, QSettings::IniFormat};
+	QList<RootConfig> roots;
+	for(const auto &group : settings.childGroups()) {
+		settings.beginGroup(group);
+		RootConfig root;
+		root.name = group;
+		root.rootDir = settings.value(QStringLiteral("root")).toString();
+		if(root.rootDir.isEmpty())
+			throw QStringLiteral("Root %1 has no root directory configured").arg(group);
+		QDir rootDir{root.rootDir};
+		root.dbPath = settings.value(QStringLiteral("dbpath"),
+									 rootDir.absoluteFilePath(QStringLiteral("var/lib/pacman")))
+					  .toString();
+
+		const auto userRules = settings.value(QStringLiteral("userrules")).toString();
+		if(!userRules.isEmpty())
+			root.rulePaths.append({QDir{userRules}, false});
+		QDir ruleDir = settings.value(QStringLiteral("rules"),
+									  rootDir.absoluteFilePath(QStringLiteral("etc/%1/rules")
+															   .arg(QCoreApplication::applicationName())))
+					   .toString();
+		root.rulePaths.append({ruleDir, true});
+		root.rulePaths.append({QDir{ruleDir.absoluteFilePath(QStringLiteral("system"))}, true});
+
+		root.stateFile = settings.value(QStringLiteral("state"),
+										ruleDir.absoluteFilePath(QStringLiteral("../state.conf")))
+						 .toString();
+		settings.endGroup();
+		roots.append(root);
+	}
+	return roots;
+}
+
+QString global::RootConfig::rulesKey() const
+{
+	QStringList paths;
+	paths.reserve(rulePaths.size());
+	for(const auto &path : rulePaths)
+		paths.append(QStringLiteral("%1:%2").arg(path.first.absolutePath(),
+												  path.second ? QStringLiteral("root") : QStringLiteral("user")));
+	return paths.join(QLatin1Char('\n'));
+}
@@ -2,15 +2,32 @@
 #define GLOBAL_H
 
 #include <QDir>
+#include <QList>
+#include <utility>
 
 namespace global
 {
 
+struct RootConfig {
+	QString name;
+	QString rootDir; // passed as --root to pacman, empty for the running system
+	QString dbPath; // passed as --dbpath to pacman, empty for the default
+	QList<std::pair<QDir, bool>> rulePaths; // (directory, isRoot), ordered by precedence
+	QString stateFile;
+
+	QString rulesKey() const;
+};
+
 bool isRoot();
 
+QString userName();
 QDir userPath();
+QList<std::pair<QString, QDir>> userRulePaths(); // (user, rule directory) of every user that has rules
 QDir rootPath();
 QDir systemPath();
+
+RootConfig hostRoot();
+QList<RootConfig> readRoots(const QString &configFile);
 }
 
 #endif // GLOBAL_H
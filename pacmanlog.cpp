@@ -0,0 +1,86 @@
+#include "pacmanlog.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+#include <QRegularExpression>
+
+#include <cerrno>
+#include <sys/stat.h>
+
+QHash<QString, pacmanlog::Change> pacmanlog::readChanges(const QString &path, Position &position, bool latestOnly)
+{
+	QHash<QString, Change> changes;
+	QFile file{path};
+	if(!file.open(QIODevice::ReadOnly)) {
+		throw QStringLiteral("Failed to open pacman log %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+
+	// a rotated log has a new inode, and one that was truncated and rewritten a different first line
+	struct stat fileStat;
+	if(::fstat(file.handle(), &fileStat) != 0) {
+		throw QStringLiteral("Failed to stat pacman log %1 with error: %2")
+				.arg(path, qt_error_string(errno));
+	}
+	auto firstLine = file.readLine();
+	if(!firstLine.endsWith('\n'))
+		firstLine.clear();
+	const auto fileId = QByteArray::number(static_cast<quint64>(fileStat.st_ino)) + ':' +
+						QCryptographicHash::hash(firstLine, QCryptographicHash::Sha1).toHex();
+	auto &offset = position.offset;
+	if(!position.fileId.isEmpty() && position.fileId != fileId) {
+		if(offset > 0)
+			qWarning().noquote() << "Pacman log" << path << "was rotated, reading it from the start";
+		offset = 0;
+	} else if(offset > file.size()) // a smaller log was truncated, so start over
+		offset = 0;
+	position.fileId = fileId;
+	if(!file.seek(offset)) {
+		throw QStringLiteral("Failed to seek pacman log %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+
+	// [<time>] [ALPM] upgraded <pkg> (<old> -> <new>)
+	static const QRegularExpression lineRegex {
+		QStringLiteral(R"__(^\[[^\]]+\] \[ALPM\] (installed|reinstalled|upgraded|downgraded|removed) (\S+) \(([^\s)]+)(?: -> ([^\s)]+))?\))__")
+	};
+	const auto alpmTag = QByteArrayLiteral("] [ALPM] ");
+	auto lineCount = 0;
+	while(!file.atEnd()) {
+		const auto line = file.readLine();
+		// the line is still being written, leave it for the next run
+		if(!line.endsWith('\n'))
+			break;
+		offset += line.size();
+		lineCount++;
+		if(!line.contains(alpmTag))
+			continue;
+
+		const auto match = lineRegex.match(QString::fromUtf8(line));
+		if(!match.hasMatch())
+			continue;
+		const auto action = match.capturedRef(1);
+		const auto pkg = match.captured(2);
+		if(action == QStringLiteral("removed")) {
+			changes.remove(pkg);
+			continue;
+		}
+
+		const auto hasOld = match.lastCapturedIndex() >= 4;
+		const auto newVersion = hasOld ? match.captured(4) : match.captured(3);
+		auto it = changes.find(pkg);
+		if(it == changes.end() || latestOnly) {
+			Change change;
+			if(hasOld)
+				change.oldVersion = match.captured(3);
+			else if(action == QStringLiteral("reinstalled"))
+				change.oldVersion = newVersion;
+			change.newVersion = newVersion;
+			changes.insert(pkg, change);
+		} else
+			it->newVersion = newVersion;
+	}
+
+	qDebug() << "Read" << changes.size() << "package changes from" << lineCount << "lines of" << path;
+	return changes;
+}
@@ -0,0 +1,27 @@
+#ifndef PACMANLOG_H
+#define PACMANLOG_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+namespace pacmanlog
+{
+
+struct Change {
+	QString oldVersion; // empty for fresh installs
+	QString newVersion;
+};
+
+struct Position {
+	qint64 offset = 0;
+	QByteArray fileId; // inode and hash of the first line, changes when the log is rotated
+};
+
+// streams the log starting at the position, merging all changes of a package into one (first old -> last new version)
+// with latestOnly, only the last change of every package is kept instead
+// the position is advanced past the last complete line, so the next call continues from there
+QHash<QString, Change> readChanges(const QString &path, Position &position, bool latestOnly = false);
+}
+
+#endif // PACMANLOG_H
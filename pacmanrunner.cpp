@@ -1,16 +1,28 @@
 #include "pacmanrunner.h"
 
 #include <QDebug>
+#include <QFileInfo>
+#include <QFile>
 #include <QSettings>
 #include <QStandardPaths>
 #include <QCoreApplication>
 #include <QRegularExpression>
+#include <QUrl>
+#include <QtConcurrent>
+#include "pkgdb.h"
+#include "admissioncontrol.h"
 
 #include <unistd.h>
 #include <cerrno>
 
 PacmanRunner::PacmanRunner(QObject *parent) :
-	QObject(parent)
+	PacmanRunner{global::hostRoot(), parent}
+{}
+
+PacmanRunner::PacmanRunner(const global::RootConfig &root, QObject *parent) :
+	QObject(parent),
+	_rootDir{root.rootDir},
+	_dbPath{root.dbPath}
 {}
 
 std::tuple<QStringList, bool> PacmanRunner::frontend() const
@@ -37,9 +49,19 @@ std::tuple<QStringList, bool> PacmanRunner::frontend() const
 QString PacmanRunner::frontendDescription() const
 {
 	auto fn = frontend();
-	return QStringLiteral("%1 %2")
-			.arg(std::get<0>(fn).join(QLatin1Char(' ')),
-				 std::get<1>(fn) ? QStringLiteral("<package wave> ...") : QStringLiteral("<all packages...>"));
+	auto description = QStringLiteral("%1 %2")
+					   .arg(std::get<0>(fn).join(QLatin1Char(' ')),
+							std::get<1>(fn) ? QStringLiteral("<package wave> ...") : QStringLiteral("<all packages...>"));
+	const auto remote = prefetchRemote();
+	if(!remote.isEmpty())
+		description += QStringLiteral("\nPrefetching sources from: %1").arg(remote);
+	const auto pkgDest = batchDestination();
+	if(!pkgDest.isEmpty())
+		description += QStringLiteral("\nBuilding with makepkg into %1, installing once per wave").arg(pkgDest);
+	const auto repositories = substituteRepositories();
+	if(!repositories.isEmpty())
+		description += QStringLiteral("\nSubstituting binaries from: %1").arg(repositories.join(QStringLiteral(", ")));
+	return description;
 }
 
 void PacmanRunner::setFrontend(const QStringList &cli, bool waved)
@@ -57,74 +79,121 @@ void PacmanRunner::resetFrontend()
 	settings.remove(QStringLiteral("frontend"));
 }
 
-int PacmanRunner::run(const QList<QStringList> &waves)
+QString PacmanRunner::prefetchRemote() const
 {
-	if(waves.isEmpty()) {
-		qWarning() << "No packages need to be rebuilt";
-		return EXIT_SUCCESS;
+	QSettings settings;
+	return settings.value(QStringLiteral("prefetch/remote")).toString();
+}
+
+void PacmanRunner::setPrefetchRemote(const QString &remote)
+{
+	QSettings settings;
+	if(remote.isEmpty()) {
+		settings.remove(QStringLiteral("prefetch"));
+		qDebug() << "Disabled source prefetching";
+	} else {
+		settings.setValue(QStringLiteral("prefetch/remote"), remote);
+		qDebug() << "Prefetching sources from" << remote;
 	}
+}
 
-	//check if all packages are installed
+QString PacmanRunner::batchDestination() const
+{
+	QSettings settings;
+	return settings.value(QStringLiteral("batch/pkgdest")).toString();
+}
+
+void PacmanRunner::setBatchDestination(const QString &pkgDest)
+{
+	QSettings settings;
+	if(pkgDest.isEmpty()) {
+		settings.remove(QStringLiteral("batch"));
+		qDebug() << "Disabled batched installation";
+	} else {
+		settings.setValue(QStringLiteral("batch/pkgdest"), QDir{pkgDest}.absolutePath());
+		qDebug() << "Building packages into" << pkgDest << "and installing them once per wave";
+	}
+}
+
+QStringList PacmanRunner::substituteRepositories() const
+{
+	QSettings settings;
+	return settings.value(QStringLiteral("substitute/repositories")).toStringList();
+}
+
+void PacmanRunner::setSubstituteRepositories(const QStringList &repositories)
+{
+	QSettings settings;
+	if(repositories.isEmpty()) {
+		settings.remove(QStringLiteral("substitute"));
+		qDebug() << "Disabled binary substitution";
+	} else {
+		settings.setValue(QStringLiteral("substitute/repositories"), repositories);
+		qDebug() << "Substituting binaries from" << repositories;
+	}
+}
+
+void PacmanRunner::checkInstalled(const QStringList &pkgs)
+{
 	QProcess proc;
-	initPacman(proc);
+	initPacman(proc, QStringList{QStringLiteral("-Qi")} + pkgs);
 	proc.setStandardOutputFile(QProcess::nullDevice());
-	QStringList pacArgs {QStringLiteral("-Qi")};
-	for(const auto& pkgs : waves)
-		pacArgs.append(pkgs);
-	proc.setArguments(pacArgs);
 
 	qDebug() << "Checking if all packages are still installed...";
 	proc.start();
 	proc.waitForFinished(-1);
 	if(proc.exitCode() != EXIT_SUCCESS)
 		throw QStringLiteral("Please remove repkg files of uninstalled packages and mark the unchanged via `repkg clear <pkg>`");
+}
 
-	// run the frontend to reinstall packages
-	QStringList cliArgs;
-	bool waved;
-	std::tie(cliArgs, waved) = frontend();
-	auto bin = QStandardPaths::findExecutable(cliArgs.takeFirst());
-	if(bin.isNull())
-		throw QStringLiteral("Unable to find binary \"%1\" in PATH").arg(bin);
-	if(waved) {
-		for(const auto& pkgs : waves) {
-			auto args = cliArgs;
-			args.append(pkgs);
-			auto res = QProcess::execute(bin, args);
-			if(res != EXIT_SUCCESS)
-				return res;
-		}
-		return EXIT_SUCCESS;
-	} else {
-		for(const auto& pkgs : waves)
-			cliArgs.append(pkgs);
-
-		// prepare arguments
-		auto argSize = cliArgs.size() + 1;
-		QByteArrayList rawArgs;
-		rawArgs.reserve(argSize);
-		QVector<char*> execArgs{argSize + 1, nullptr};
-		// bin
-		rawArgs.append(bin.toUtf8());
-		execArgs[0] = rawArgs[0].data();
-		// args
-		for(auto i = 1; i < argSize; i++) {
-			rawArgs.append(cliArgs[i - 1].toUtf8());
-			execArgs[i] = rawArgs[i].data();
-		}
+int PacmanRunner::runFrontend(const QStringList &pkgs, AdmissionControl *admission, const QProcessEnvironment &env)
+{
+	auto cliArgs = frontendCommand();
+	QProcess proc;
+	proc.setProgram(cliArgs.takeFirst());
+	proc.setArguments(cliArgs + pkgs);
+	proc.setProcessEnvironment(env);
+	proc.setProcessChannelMode(QProcess::ForwardedChannels);
+	proc.setInputChannelMode(QProcess::ForwardedInputChannel);
 
-		::execv(execArgs[0], execArgs.data());
-		//unexcepted error
-		throw QStringLiteral("execv failed with error: %1").arg(qt_error_string(errno));
+	int result;
+	if(admission)
+		result = admission->execute(proc, pkgs);
+	else {
+		proc.start();
+		if(!proc.waitForFinished(-1))
+			result = -2;
+		else
+			result = proc.exitStatus() == QProcess::NormalExit ? proc.exitCode() : -1;
 	}
+	reloadLocalDb();
+	return result;
+}
+
+void PacmanRunner::execFrontend(const QStringList &pkgs)
+{
+	auto cliArgs = frontendCommand() + pkgs;
+
+	// prepare arguments
+	auto argSize = cliArgs.size();
+	QByteArrayList rawArgs;
+	rawArgs.reserve(argSize);
+	QVector<char*> execArgs{argSize + 1, nullptr};
+	for(auto i = 0; i < argSize; i++) {
+		rawArgs.append(cliArgs[i].toUtf8());
+		execArgs[i] = rawArgs[i].data();
+	}
+
+	::execv(execArgs[0], execArgs.data());
+	//unexcepted error
+	throw QStringLiteral("execv failed with error: %1").arg(qt_error_string(errno));
 }
 
 QString PacmanRunner::readPackageVersion(const QString &pkg)
 {
 	//read the package version from pacman
 	QProcess proc;
-	initPacman(proc);
-	proc.setArguments({QStringLiteral("-Q"), pkg});
+	initPacman(proc, {QStringLiteral("-Q"), pkg});
 
 	qDebug() << "Querying package version of" << pkg << "...";
 	proc.start();
@@ -144,8 +213,7 @@ QString PacmanRunner::readPackageVersion(const QString &pkg)
 QStringList PacmanRunner::readForeignPackages()
 {
 	QProcess proc;
-	initPacman(proc);
-	proc.setArguments({QStringLiteral("-Qqm")});
+	initPacman(proc, {QStringLiteral("-Qqm")});
 
 	qDebug() << "Querying all foreign packages...";
 	proc.start();
@@ -159,12 +227,11 @@ QStringList PacmanRunner::readForeignPackages()
 QStringList PacmanRunner::listDependencies(const QString &pkg)
 {
 	QProcess proc;
-	initPacman(proc, true);
-	proc.setArguments({
-						  QStringLiteral("-u"),
-						  QStringLiteral("-d1"),
-						  pkg
-					  });
+	initPacman(proc, {
+				   QStringLiteral("-u"),
+				   QStringLiteral("-d1"),
+				   pkg
+			   }, true);
 
 	qDebug() << "Querying all dependencies of the" << pkg <<  "package...";
 	proc.start();
@@ -176,7 +243,302 @@ QStringList PacmanRunner::listDependencies(const QString &pkg)
 	return QString::fromUtf8(proc.readAllStandardOutput()).simplified().split(QLatin1Char(' ')).mid(1);
 }
 
-void PacmanRunner::initPacman(QProcess &proc, bool asPactree) const
+QStringList PacmanRunner::readInstalledPackages() const
+{
+	auto pkgs = localIndex().keys();
+	std::sort(pkgs.begin(), pkgs.end());
+	return pkgs;
+}
+
+QDateTime PacmanRunner::localDbModified() const
+{
+	return QFileInfo{localDb().absolutePath()}.lastModified();
+}
+
+pkgdb::Desc PacmanRunner::readLocalDesc(const QString &pkg) const
+{
+	const auto entry = localIndex().value(pkg);
+	if(entry.isNull())
+		return {};
+
+	QFile file{localDb().absoluteFilePath(entry + QStringLiteral("/desc"))};
+	if(!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		qWarning() << "Failed to read file" << file.fileName()
+				   << "with error" << file.errorString();
+		return {};
+	}
+	return pkgdb::parseDesc(file.readAll());
+}
+
+quint64 PacmanRunner::readInstalledSize(const QString &pkg) const
+{
+	return readLocalDesc(pkg).value(QStringLiteral("SIZE")).value(0).toULongLong();
+}
+
+QString PacmanRunner::readLocalVersion(const QString &pkg) const
+{
+	// the database entry already contains the full version
+	const auto entry = localIndex().value(pkg);
+	if(entry.isNull())
+		return {};
+	return entry.mid(pkg.size() + 1);
+}
+
+QString PacmanRunner::readPackageBase(const QString &pkg) const
+{
+	const auto base = readLocalDesc(pkg).value(QStringLiteral("BASE")).value(0);
+	return base.isEmpty() ? pkg : base;
+}
+
+QByteArray PacmanRunner::readFileFingerprint(const QString &pkg) const
+{
+	const auto entry = localIndex().value(pkg);
+	if(entry.isNull())
+		return {};
+	const auto mtree = localDb().absoluteFilePath(entry + QStringLiteral("/mtree"));
+	if(!QFileInfo::exists(mtree))
+		return {};
+	try {
+		return pkgdb::mtreeFingerprint(mtree);
+	} catch(QString &e) {
+		qWarning().noquote() << e;
+		return {};
+	}
+}
+
+void PacmanRunner::reloadLocalDb()
+{
+	// installed versions change with every transaction, which renames the database entries
+	_localIndex.clear();
+}
+
+QString PacmanRunner::logFile() const
+{
+	// an explicit LogFile in pacman.conf wins, otherwise the log is inside the root
+	const QDir root{_rootDir.isEmpty() ? QStringLiteral("/") : _rootDir};
+	QFile conf{root.absoluteFilePath(QStringLiteral("etc/pacman.conf"))};
+	if(conf.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		static const QRegularExpression sectionRegex{QStringLiteral(R"__(^\s*\[(.+)\]\s*$)__")};
+		static const QRegularExpression logFileRegex{QStringLiteral(R"__(^\s*LogFile\s*=\s*(.+?)\s*$)__")};
+		auto inOptions = false;
+		while(!conf.atEnd()) {
+			const auto line = QString::fromUtf8(conf.readLine());
+			const auto section = sectionRegex.match(line);
+			if(section.hasMatch()) {
+				inOptions = section.captured(1) == QStringLiteral("options");
+				continue;
+			}
+			const auto logMatch = logFileRegex.match(line);
+			if(inOptions && logMatch.hasMatch())
+				return logMatch.captured(1);
+		}
+	}
+	return root.absoluteFilePath(QStringLiteral("var/log/pacman.log"));
+}
+
+QStringList PacmanRunner::listSyncDbs() const
+{
+	auto syncDir = localDb();
+	if(!syncDir.cd(QStringLiteral("../sync")))
+		return {};
+	syncDir.setFilter(QDir::Files | QDir::Readable);
+	syncDir.setNameFilters({QStringLiteral("*.db")});
+	auto dbs = syncDir.entryList();
+
+	// use the repository order of pacman.conf, as the first repository providing a package wins
+	QFile conf{QDir{_rootDir.isEmpty() ? QStringLiteral("/") : _rootDir}.absoluteFilePath(QStringLiteral("etc/pacman.conf"))};
+	QStringList repos;
+	if(conf.open(QIODevice::ReadOnly | QIODevice::Text)) {
+		static const QRegularExpression sectionRegex{QStringLiteral(R"__(^\s*\[(.+)\]\s*$)__")};
+		while(!conf.atEnd()) {
+			const auto match = sectionRegex.match(QString::fromUtf8(conf.readLine()));
+			if(match.hasMatch() && match.captured(1) != QStringLiteral("options"))
+				repos.append(match.captured(1) + QStringLiteral(".db"));
+		}
+	}
+	std::stable_sort(dbs.begin(), dbs.end(), [&repos](const QString &lhs, const QString &rhs) {
+		return static_cast<uint>(repos.indexOf(lhs)) < static_cast<uint>(repos.indexOf(rhs));
+	});
+
+	for(auto &db : dbs)
+		db = syncDir.absoluteFilePath(db);
+	return dbs;
+}
+
+QHash<QString, QString> PacmanRunner::readSyncUpgrades() const
+{
+	struct DbScan {
+		QString path;
+		QHash<QString, QString> versions;
+		QString error;
+	};
+
+	QVector<DbScan> scans;
+	for(const auto &db : listSyncDbs())
+		scans.append(DbScan{db, {}, {}});
+
+	// stream all databases in parallel, only keeping the versions of installed packages
+	const auto &installed = localIndex();
+	QtConcurrent::blockingMap(scans, [&installed](DbScan &scan) {
+		try {
+			qDebug() << "Reading sync database" << scan.path << "...";
+			pkgdb::readDatabase(scan.path, [&installed, &scan](const pkgdb::Desc &desc) {
+				const auto name = desc.value(QStringLiteral("NAME")).value(0);
+				if(installed.contains(name))
+					scan.versions.insert(name, desc.value(QStringLiteral("VERSION")).value(0));
+			});
+		} catch(QString &e) {
+			scan.error = e;
+		}
+	});
+
+	// merge in repository order, the first repository wins
+	QHash<QString, QString> candidates;
+	for(const auto &scan : qAsConst(scans)) {
+		if(!scan.error.isNull())
+			throw scan.error;
+		for(auto it = scan.versions.constBegin(); it != scan.versions.constEnd(); it++) {
+			if(!candidates.contains(it.key()))
+				candidates.insert(it.key(), it.value());
+		}
+	}
+
+	QHash<QString, QString> upgrades;
+	for(auto it = candidates.constBegin(); it != candidates.constEnd(); it++) {
+		if(pkgdb::vercmp(it.value(), readLocalVersion(it.key())) > 0)
+			upgrades.insert(it.key(), it.value());
+	}
+	return upgrades;
+}
+
+QHash<QString, QString> PacmanRunner::findSubstitutes(const QMap<QString, QSet<QString>> &pkgs) const
+{
+	QHash<QString, QString> substitutes;
+	if(pkgs.isEmpty())
+		return substitutes;
+
+	for(const auto &repository : substituteRepositories()) {
+		// only local repositories are supported, the packages are installed directly from there
+		const QUrl url{repository};
+		if(!url.scheme().isEmpty() && !url.isLocalFile()) {
+			qWarning() << "Skipping substitute repository" << repository << "- only local and file:// repositories are supported";
+			continue;
+		}
+		const QFileInfo dbInfo{url.isLocalFile() ? url.toLocalFile() : repository};
+		if(!dbInfo.exists()) {
+			qWarning() << "Skipping substitute repository" << repository << "- the database does not exist";
+			continue;
+		}
+
+		qDebug() << "Searching substitute repository" << dbInfo.absoluteFilePath() << "...";
+		pkgdb::readDatabase(dbInfo.absoluteFilePath(), [&](const pkgdb::Desc &desc) {
+			const auto name = desc.value(QStringLiteral("NAME")).value(0);
+			if(!pkgs.contains(name) || substitutes.contains(name))
+				return;
+
+			// must be a newer build than the installed one...
+			const auto version = desc.value(QStringLiteral("VERSION")).value(0);
+			if(pkgdb::vercmp(version, readLocalVersion(name)) <= 0)
+				return;
+			// ...that was built after all the packages that triggered the rebuild
+			const auto buildDate = desc.value(QStringLiteral("BUILDDATE")).value(0).toLongLong();
+			for(const auto &trigger : pkgs.value(name)) {
+				const auto triggerDate = readLocalDesc(trigger).value(QStringLiteral("BUILDDATE")).value(0).toLongLong();
+				if(buildDate < triggerDate) {
+					qDebug() << "Ignoring substitute" << name << version << "- it was built before" << trigger;
+					return;
+				}
+			}
+
+			const auto file = dbInfo.dir().absoluteFilePath(desc.value(QStringLiteral("FILENAME")).value(0));
+			if(!QFileInfo{file}.isFile()) {
+				qWarning() << "Ignoring substitute" << name << version << "- the package file" << file << "is missing";
+				return;
+			}
+			qDebug() << "Found substitute for" << name << ":" << file;
+			substitutes.insert(name, file);
+		});
+	}
+	return substitutes;
+}
+
+bool PacmanRunner::installPackages(const QStringList &files)
+{
+	QProcess proc;
+	initPacman(proc, QStringList{QStringLiteral("-U"), QStringLiteral("--noconfirm")} + files);
+	proc.setProcessChannelMode(QProcess::ForwardedChannels);
+	if(!global::isRoot()) {
+		const auto sudo = QStandardPaths::findExecutable(QStringLiteral("sudo"));
+		if(sudo.isNull())
+			throw QStringLiteral("Unable to find sudo binary in PATH");
+		proc.setArguments(QStringList{proc.program()} + proc.arguments());
+		proc.setProgram(sudo);
+	}
+
+	qDebug() << "Installing" << files.size() << "prebuilt packages...";
+	proc.start();
+	proc.waitForFinished(-1);
+	reloadLocalDb();
+	return proc.exitStatus() == QProcess::NormalExit && proc.exitCode() == EXIT_SUCCESS;
+}
+
+QStringList PacmanRunner::buildPackages(const QString &buildDir, const QString &pkgDest, const QStringList &pkgs, AdmissionControl *admission, QProcessEnvironment env)
+{
+	const auto makepkg = QStandardPaths::findExecutable(QStringLiteral("makepkg"));
+	if(makepkg.isNull())
+		throw QStringLiteral("Unable to find makepkg binary in PATH");
+	if(!QDir{}.mkpath(pkgDest))
+		throw QStringLiteral("Failed to create package destination %1").arg(pkgDest);
+
+	QProcess proc;
+	proc.setProgram(makepkg);
+	proc.setWorkingDirectory(buildDir);
+	env.insert(QStringLiteral("PKGDEST"), pkgDest);
+	proc.setProcessEnvironment(env);
+
+	// build without installing, the packages are installed together with the rest of the wave
+	proc.setArguments({QStringLiteral("--syncdeps"), QStringLiteral("--force"), QStringLiteral("--noconfirm")});
+	proc.setProcessChannelMode(QProcess::ForwardedChannels);
+	qDebug() << "Building packages in" << buildDir << "...";
+	if(admission) {
+		if(admission->execute(proc, pkgs) != EXIT_SUCCESS)
+			return {};
+		proc.setProgram(makepkg);
+	} else {
+		proc.start();
+		proc.waitForFinished(-1);
+		if(proc.exitStatus() != QProcess::NormalExit || proc.exitCode() != EXIT_SUCCESS)
+			return {};
+	}
+
+	proc.setArguments({QStringLiteral("--packagelist")});
+	proc.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+	proc.start();
+	proc.waitForFinished(-1);
+	if(proc.exitStatus() != QProcess::NormalExit || proc.exitCode() != EXIT_SUCCESS)
+		return {};
+	auto files = QString::fromUtf8(proc.readAllStandardOutput()).split(QLatin1Char('\n'), QString::SkipEmptyParts);
+	for(auto it = files.begin(); it != files.end();) {
+		// makepkg also lists debug packages that were not created
+		if(QFileInfo::exists(*it))
+			it++;
+		else
+			it = files.erase(it);
+	}
+	return files;
+}
+
+QStringList PacmanRunner::frontendCommand() const
+{
+	auto cliArgs = std::get<0>(frontend());
+	auto bin = QStandardPaths::findExecutable(cliArgs.first());
+	if(bin.isNull())
+		throw QStringLiteral("Unable to find binary \"%1\" in PATH").arg(cliArgs.first());
+	cliArgs[0] = bin;
+	return cliArgs;
+}
+
+void PacmanRunner::initPacman(QProcess &proc, const QStringList &args, bool asPactree) const
 {
 	auto pacman = asPactree ?
 					  QStandardPaths::findExecutable(QStringLiteral("pactree")) :
@@ -185,4 +547,38 @@ void PacmanRunner::initPacman(QProcess &proc, bool asPactree) const
 		throw QStringLiteral("Unable to find %1 binary in PATH").arg(asPactree ? QStringLiteral("vercmp") :QStringLiteral("pacman"));
 	proc.setProgram(pacman);
 	proc.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+
+	// redirect to alternate roots, pactree only knows about the database
+	QStringList rootArgs;
+	if(!_rootDir.isEmpty() && !asPactree)
+		rootArgs << QStringLiteral("--root") << _rootDir;
+	if(!_dbPath.isEmpty())
+		rootArgs << QStringLiteral("--dbpath") << _dbPath;
+	proc.setArguments(rootArgs + args);
+}
+
+QDir PacmanRunner::localDb() const
+{
+	if(_dbPath.isEmpty())
+		return QStringLiteral("/var/lib/pacman/local");
+	else
+		return QDir{_dbPath}.absoluteFilePath(QStringLiteral("local"));
+}
+
+const QHash<QString, QString> &PacmanRunner::localIndex() const
+{
+	// read the local database directly instead of spawning pacman
+	if(_localIndex.isEmpty()) {
+		auto dir = localDb();
+		dir.setFilter(QDir::Dirs | QDir::NoDotAndDotDot);
+		for(const auto &entry : dir.entryList()) {
+			// entries are named <name>-<pkgver>-<pkgrel>
+			auto sIndex = entry.lastIndexOf(QLatin1Char('-'));
+			if(sIndex > 0)
+				sIndex = entry.lastIndexOf(QLatin1Char('-'), sIndex - 1);
+			if(sIndex > 0)
+				_localIndex.insert(entry.left(sIndex), entry);
+		}
+	}
+	return _localIndex;
 }
@@ -4,6 +4,16 @@
 #include <tuple>
 #include <QObject>
 #include <QProcess>
+#include <QDateTime>
+#include <QDir>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+
+#include "global.h"
+#include "pkgdb.h"
+
+class AdmissionControl;
 
 class PacmanRunner : public QObject
 {
@@ -11,21 +21,58 @@ class PacmanRunner : public QObject
 
 public:
 	explicit PacmanRunner(QObject *parent = nullptr);
+	explicit PacmanRunner(const global::RootConfig &root, QObject *parent = nullptr);
 
 	std::tuple<QStringList, bool> frontend() const; //(frontend, waved)
 	QString frontendDescription() const;
 	void setFrontend(const QStringList &cli, bool waved);
 	void resetFrontend();
 	bool isWaved() const;
+	QString prefetchRemote() const;
+	void setPrefetchRemote(const QString &remote);
+	QString batchDestination() const;
+	void setBatchDestination(const QString &pkgDest);
+	QStringList substituteRepositories() const;
+	void setSubstituteRepositories(const QStringList &repositories);
 
-	int run(const QList<QStringList> &pkgs);
+	void checkInstalled(const QStringList &pkgs);
+	int runFrontend(const QStringList &pkgs,
+					AdmissionControl *admission = nullptr,
+					const QProcessEnvironment &env = QProcessEnvironment::systemEnvironment());
+	[[noreturn]] void execFrontend(const QStringList &pkgs);
 
 	QString readPackageVersion(const QString &pkg);
 	QStringList readForeignPackages();
 	QStringList listDependencies(const QString &pkg);
 
+	QStringList readInstalledPackages() const;
+	QDateTime localDbModified() const;
+	pkgdb::Desc readLocalDesc(const QString &pkg) const;
+	quint64 readInstalledSize(const QString &pkg) const;
+	QString readLocalVersion(const QString &pkg) const;
+	QString readPackageBase(const QString &pkg) const;
+	QByteArray readFileFingerprint(const QString &pkg) const;
+	void reloadLocalDb();
+	QString logFile() const;
+	QStringList listSyncDbs() const;
+	QHash<QString, QString> readSyncUpgrades() const;
+	QHash<QString, QString> findSubstitutes(const QMap<QString, QSet<QString>> &pkgs) const; // package -> binary file
+	bool installPackages(const QStringList &files);
+	QStringList buildPackages(const QString &buildDir,
+							  const QString &pkgDest,
+							  const QStringList &pkgs,
+							  AdmissionControl *admission = nullptr,
+							  QProcessEnvironment env = QProcessEnvironment::systemEnvironment()); // -> built package files
+
 private:
-	void initPacman(QProcess &proc, bool asPactree = false) const;
+	QString _rootDir;
+	QString _dbPath;
+	mutable QHash<QString, QString> _localIndex; // package -> database entry
+
+	QStringList frontendCommand() const;
+	void initPacman(QProcess &proc, const QStringList &args, bool asPactree = false) const;
+	QDir localDb() const;
+	const QHash<QString, QString> &localIndex() const;
 };
 
 #endif // PACMANRUNNER_H
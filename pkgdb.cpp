@@ -0,0 +1,126 @@
+#include "pkgdb.h"
+#include <QCryptographicHash>
+#include <QFile>
+#include <memory>
+#include <alpm.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+pkgdb::Desc pkgdb::parseDesc(const QByteArray &data)
+{
+	// desc files consist of %KEY% lines, followed by the values, seperated by empty lines
+	Desc desc;
+	QString key;
+	for(const auto &rawLine : data.split('\n')) {
+		const auto line = QString::fromUtf8(rawLine).trimmed();
+		if(line.isEmpty())
+			key.clear();
+		else if(line.size() > 2 && line.startsWith(QLatin1Char('%')) && line.endsWith(QLatin1Char('%')))
+			key = line.mid(1, line.size() - 2);
+		else if(!key.isNull())
+			desc[key].append(line);
+	}
+	return desc;
+}
+
+void pkgdb::readDatabase(const QString &path, const std::function<void(const Desc&)> &handler)
+{
+	std::unique_ptr<archive, decltype(&archive_read_free)> reader{archive_read_new(), &archive_read_free};
+	archive_read_support_filter_all(reader.get());
+	archive_read_support_format_all(reader.get());
+	if(archive_read_open_filename(reader.get(), QFile::encodeName(path).constData(), 128 * 1024) != ARCHIVE_OK) {
+		throw QStringLiteral("Failed to open package database %1 with error: %2")
+				.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+	}
+
+	archive_entry *entry = nullptr;
+	QByteArray data;
+	forever {
+		const auto res = archive_read_next_header(reader.get(), &entry);
+		if(res == ARCHIVE_EOF)
+			break;
+		else if(res < ARCHIVE_WARN) {
+			throw QStringLiteral("Failed to read package database %1 with error: %2")
+					.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+		}
+
+		// entries are <name>-<pkgver>-<pkgrel>/{desc,files}, only the descs are of interest
+		const auto entryPath = QByteArray{archive_entry_pathname(entry)};
+		if(!entryPath.endsWith("/desc")) {
+			archive_read_data_skip(reader.get());
+			continue;
+		}
+
+		data.resize(static_cast<int>(archive_entry_size(entry)));
+		auto offset = 0;
+		while(offset < data.size()) {
+			const auto read = archive_read_data(reader.get(), data.data() + offset, static_cast<size_t>(data.size() - offset));
+			if(read < 0) {
+				throw QStringLiteral("Failed to read package database %1 with error: %2")
+						.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+			} else if(read == 0)
+				break;
+			offset += static_cast<int>(read);
+		}
+		data.resize(offset);
+		handler(parseDesc(data));
+	}
+}
+
+QByteArray pkgdb::mtreeFingerprint(const QString &path)
+{
+	// the mtree is a gzipped text file, so only the compression has to be handled by libarchive
+	std::unique_ptr<archive, decltype(&archive_read_free)> reader{archive_read_new(), &archive_read_free};
+	archive_read_support_filter_all(reader.get());
+	archive_read_support_format_raw(reader.get());
+	if(archive_read_open_filename(reader.get(), QFile::encodeName(path).constData(), 64 * 1024) != ARCHIVE_OK) {
+		throw QStringLiteral("Failed to open mtree %1 with error: %2")
+				.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+	}
+	archive_entry *entry = nullptr;
+	if(archive_read_next_header(reader.get(), &entry) != ARCHIVE_OK) {
+		throw QStringLiteral("Failed to read mtree %1 with error: %2")
+				.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+	}
+
+	QByteArray data;
+	char buffer[64 * 1024];
+	forever {
+		const auto read = archive_read_data(reader.get(), buffer, sizeof(buffer));
+		if(read < 0) {
+			throw QStringLiteral("Failed to read mtree %1 with error: %2")
+					.arg(path, QString::fromUtf8(archive_error_string(reader.get())));
+		} else if(read == 0)
+			break;
+		data.append(buffer, static_cast<int>(read));
+	}
+
+	// timestamps differ for every build, and the metadata files contain the build date,
+	// so only what the files actually contain is taken into account
+	QList<QByteArray> lines;
+	for(const auto &line : data.split('\n')) {
+		const auto fields = line.simplified().split(' ');
+		const auto &file = fields.first();
+		if(!file.startsWith("./") || file == "./.BUILDINFO" || file == "./.PKGINFO")
+			continue;
+		QByteArray key = file;
+		for(const auto &field : fields.mid(1)) {
+			if(field.startsWith("sha256digest=") || field.startsWith("link=") || field.startsWith("type="))
+				key += ' ' + field;
+		}
+		lines.append(key);
+	}
+	std::sort(lines.begin(), lines.end());
+
+	QCryptographicHash hash{QCryptographicHash::Sha256};
+	for(const auto &line : qAsConst(lines)) {
+		hash.addData(line);
+		hash.addData("\n", 1);
+	}
+	return hash.result();
+}
+
+int pkgdb::vercmp(const QString &lhs, const QString &rhs)
+{
+	return alpm_pkg_vercmp(lhs.toUtf8().constData(), rhs.toUtf8().constData());
+}
@@ -0,0 +1,24 @@
+#ifndef PKGDB_H
+#define PKGDB_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QStringList>
+#include <functional>
+
+namespace pkgdb
+{
+
+using Desc = QHash<QString, QStringList>; // %KEY% -> values
+
+Desc parseDesc(const QByteArray &data);
+// streams the archive and passes every package desc to the handler, without extracting anything
+void readDatabase(const QString &path, const std::function<void(const Desc&)> &handler);
+
+// hashes the paths, link targets and content digests of all files listed in a local database mtree
+QByteArray mtreeFingerprint(const QString &path);
+
+int vercmp(const QString &lhs, const QString &rhs);
+}
+
+#endif // PKGDB_H
@@ -3,15 +3,34 @@
 
 #include <QCoreApplication>
 #include <QDebug>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QProcess>
 #include <QQueue>
 #include <QStandardPaths>
 #include <QRegularExpression>
+#include <algorithm>
+
+#include <sys/file.h>
+#include <sys/stat.h>
 using namespace global;
 
 PkgResolver::PkgResolver(PacmanRunner *runner, RuleController *controller, QObject *parent) :
+	PkgResolver{hostRoot(), runner, controller, parent}
+{
+	_host = true;
+	// when the hook evaluated the rules of multiple users, everyone has their own pending packages
+	const auto user = userName();
+	_settings->beginGroup(QStringLiteral("users"));
+	if(!user.isEmpty() && _settings->childGroups().contains(user))
+		_owner = user;
+	_settings->endGroup();
+}
+
+PkgResolver::PkgResolver(const RootConfig &root, PacmanRunner *runner, RuleController *controller, QObject *parent) :
 	QObject{parent},
 	_settings{new QSettings{
-		rootPath().absoluteFilePath(QStringLiteral("../state.conf")),
+		root.stateFile,
 		QSettings::IniFormat,
 		this
 	}},
@@ -21,52 +40,73 @@ PkgResolver::PkgResolver(PacmanRunner *runner, RuleController *controller, QObje
 
 QStringList PkgResolver::listPkgs() const
 {
-	return readPkgs().keys();
+	return readPendingPkgs().keys();
 }
 
 QString PkgResolver::listDetailPkgs() const
 {
-	QStringList pkgs;
-	pkgs.append(QStringLiteral("%1| Triggered by").arg(QStringLiteral(" Package Update"), -30));
-	pkgs.append(QStringLiteral("-").repeated(30) + QLatin1Char('|') + QStringLiteral("-").repeated(49));
-
-	auto pkgInfos = readPkgs();
-	for(auto it = pkgInfos.constBegin(); it != pkgInfos.constEnd(); it++) {
-		auto lst = it.value().toList();
-		std::sort(lst.begin(), lst.end());
-		pkgs.append(QStringLiteral("%1| %2")
-					.arg(it.key(), -30)
-					.arg(lst.join(QStringLiteral(", "))));
-	}
-	return pkgs.join(QLatin1Char('\n'));
+	const auto pkgInfos = readPendingPkgs();
+	return formatDetail(pkgInfos, readPkgBases(pkgInfos.keys()));
 }
 
 QList<QStringList> PkgResolver::listPkgWaves() const
 {
-	auto pkgs = readPkgs();
+	const auto pkgInfos = readPendingPkgs();
+	return calcWaves(pkgInfos, readPkgBases(pkgInfos.keys()));
+}
 
-	QList<QStringList> waves;
-	while(!pkgs.isEmpty()) {
-		//find all packages that dont have a trigger that needs to be rebuild as well
-		const auto keys = QSet<QString>::fromList(pkgs.keys());
-		QStringList wave;
-		for(auto it = pkgs.begin(); it != pkgs.end();) {
-			if(keys.intersects(it.value()))
-				it++; //has a trigger dep, postpone for later
-			else {
-				wave.append(it.key());
-				it = pkgs.erase(it);
-			}
-		}
-		if(wave.isEmpty()) {
-			throw QStringLiteral("Cyclic dependencies detected! Is within packages: %1")
-					.arg(keys.toList().join(QLatin1Char(' ')));
+QList<QStringList> PkgResolver::listPkgWaves(const QStringList &targets) const
+{
+	if(targets.isEmpty())
+		return listPkgWaves();
+
+	// collect the targets and all pending packages they (transitively) depend on
+	const auto pkgInfos = readPendingPkgs();
+	PkgInfos subset;
+	QQueue<QString> pkgQueue;
+	for(const auto &pkg : targets) {
+		if(!pkgInfos.contains(pkg))
+			throw QStringLiteral("Package %1 is not marked to be rebuilt").arg(pkg);
+		pkgQueue.enqueue(pkg);
+	}
+	while(!pkgQueue.isEmpty()) {
+		const auto pkg = pkgQueue.dequeue();
+		if(subset.contains(pkg))
+			continue;
+		const auto triggers = pkgInfos.value(pkg);
+		subset.insert(pkg, triggers);
+		for(const auto &trigger : triggers) {
+			if(pkgInfos.contains(trigger))
+				pkgQueue.enqueue(trigger);
 		}
-		waves.append(wave);
-		qDebug() << "Calculated wave:" << wave.join(QLatin1Char(' '));
 	}
 
-	return waves;
+	// split packages are always built together, so their siblings must be included as well
+	const auto pkgBases = readPkgBases(pkgInfos.keys());
+	const auto subsetBases = QSet<QString>::fromList(readPkgBases(subset.keys()).values());
+	for(auto it = pkgBases.constBegin(); it != pkgBases.constEnd(); it++) {
+		if(!subset.contains(it.key()) && subsetBases.contains(it.value()))
+			subset.insert(it.key(), pkgInfos.value(it.key()));
+	}
+
+	qDebug() << "Rebuilding" << subset.size() << "of" << pkgInfos.size() << "pending packages";
+	return calcWaves(subset, pkgBases);
+}
+
+PkgResolver::PkgInfos PkgResolver::listPkgInfos() const
+{
+	return readPendingPkgs();
+}
+
+PkgResolver::PkgInfos PkgResolver::listEvaluatedPkgInfos() const
+{
+	return readPkgs(_owner);
+}
+
+void PkgResolver::reload()
+{
+	// the hook changes the state from within other processes
+	_settings->sync();
 }
 
 void PkgResolver::updatePkgs(const QStringList &pkgs)
@@ -74,50 +114,67 @@ void PkgResolver::updatePkgs(const QStringList &pkgs)
 	if(!isRoot())
 		throw QStringLiteral("Must be run as root to update packages!");
 
-	QQueue<QString> pkgQueue;
-	for(const auto& pkg : pkgs)
-		pkgQueue.enqueue(pkg);
+	// transactions queued before must be evaluated first, to keep the order
+	processQueue();
 
-	auto pkgInfos = readPkgs();
-	QSet<QString> skipPkgs;
+	// the log knows the exact versions of everything that changed since the last run
+	pacmanlog::Position logPosition;
+	const auto changes = readLogChanges(logPosition);
+	writeLogPosition(logPosition);
 
-	while (!pkgQueue.isEmpty()) {
-		//handle each package only once
-		auto pkg = pkgQueue.dequeue();
-		if(skipPkgs.contains(pkg))
-			continue;
+	// must happen before the evaluation, as that replaces the stored versions
+	const auto rules = ownerRules();
+	if(isRecording())
+		recordTransaction(rules, pkgs, changes);
 
-		//check if packages need updates
-		auto matches = _controller->findRules(pkg);
-		//add those to the "needs updates" list
-		//and check if they themselves will trigger rebuilds by adding them to the queue
-		for(const auto& match : matches) {
-			if(checkVersionUpdate(match, pkg)) {
-				pkgInfos[match.package].insert(pkg);
-				pkgQueue.enqueue(match.package);
-				qDebug() << "Rule triggered. Marked"
-						 << match.package
-						 << "for updates because of"
-						 << pkg;
-			} else {
-				qDebug() << "Rule skipped. Did not mark "
-						 << match.package
-						 << "for updates because version of"
-						 << pkg
-						 << "did not change significantly";
-			}
-		}
+	auto ownerInfos = readOwnerPkgs(rules);
+	QHash<QString, RuleStats> stats;
+	evaluateUpdates(rules, pkgs, ownerInfos,
+					[this, &changes](const QString &pkg) {
+						auto version = changes.value(pkg).newVersion;
+						if(version.isEmpty())
+							version = _runner->readLocalVersion(pkg);
+						if(version.isEmpty())
+							version = _runner->readPackageVersion(pkg);
+						return version;
+					},
+					[this, &changes](const QString &pkg, const QString &target, const QString &version) {
+						// without a stored version, the rule is new - use the version the package was upgraded from
+						const auto oldVersion = swapStoredVersion(pkg, target, version);
+						return oldVersion.isEmpty() ? changes.value(target).oldVersion : oldVersion;
+					},
+					&stats);
 
-		//each package only once -> skip next time
-		skipPkgs.insert(pkg);
-	}
+	//save the infos
+	writeOwnerPkgs(ownerInfos);
+	writeRuleStats(stats);
+}
 
-	//remove all "original" packages from the rebuild list as they have just been built
-	for(const auto& pkg : pkgs)
-		pkgInfos.remove(pkg);
+PkgResolver::PkgInfos PkgResolver::predictPkgs()
+{
+	const auto upgrades = _runner->readSyncUpgrades();
+	qDebug() << "Found" << upgrades.size() << "pending upgrades in the sync databases";
 
-	//save the infos
-	writePkgs(pkgInfos);
+	// evaluate with the candidate versions, but never write the state
+	const auto oldInfos = readPendingPkgs();
+	auto pkgInfos = oldInfos;
+	evaluateUpdates(upgrades.keys(), pkgInfos,
+					[this, &upgrades](const QString &pkg) {
+						const auto version = upgrades.value(pkg);
+						return version.isNull() ? _runner->readLocalVersion(pkg) : version;
+					},
+					[this](const QString &pkg, const QString &target, const QString &) {
+						return readStoredVersion(pkg, target);
+					});
+
+	// only report the packages newly marked by the upgrade
+	for(auto it = pkgInfos.begin(); it != pkgInfos.end();) {
+		if(oldInfos.value(it.key()).contains(it.value()))
+			it = pkgInfos.erase(it);
+		else
+			it++;
+	}
+	return pkgInfos;
 }
 
 void PkgResolver::clear(const QStringList &pkgs)
@@ -125,23 +182,307 @@ void PkgResolver::clear(const QStringList &pkgs)
 	if(!isRoot())
 		throw QStringLiteral("Must be run as root to clear packages!");
 
+	processQueue();
 	if(pkgs.isEmpty()) {
-		_settings->remove(QStringLiteral("pkgstate"));
+		_settings->remove(ownerKey(_owner, QStringLiteral("pkgstate")));
 		qDebug() << "Cleared all pending package rebuilds";
 	} else {
-		auto pkgInfos = readPkgs();
+		auto pkgInfos = readPkgs(_owner);
 		auto save = false;
 		for(const auto& pkg : pkgs)
 			save = pkgInfos.remove(pkg) || save;
 		if(save)
-			writePkgs(pkgInfos);
+			writePkgs(_owner, pkgInfos);
 		qDebug() << "Cleared specified pending package rebuilds";
 	}
 }
 
-PkgResolver::PkgInfos PkgResolver::readPkgs() const
+QString PkgResolver::owner() const
 {
-	auto count = _settings->beginReadArray(QStringLiteral("pkgstate"));
+	return _owner;
+}
+
+QHash<QString, PkgResolver::RuleStats> PkgResolver::readRuleStats() const
+{
+	QHash<QString, RuleStats> stats;
+	_settings->beginGroup(QStringLiteral("rulestats"));
+	for(const auto &origin : _settings->childGroups()) {
+		_settings->beginGroup(origin);
+		RuleStats ruleStats;
+		ruleStats.evaluations = _settings->value(QStringLiteral("evaluations"), 0).toULongLong();
+		ruleStats.triggers = _settings->value(QStringLiteral("triggers"), 0).toULongLong();
+		ruleStats.skips = _settings->value(QStringLiteral("skips"), 0).toULongLong();
+		stats.insert(origin, ruleStats);
+		_settings->endGroup();
+	}
+	_settings->endGroup();
+	return stats;
+}
+
+QStringList PkgResolver::findRuleOrigins(const QString &pkg, const QSet<QString> &triggers) const
+{
+	// the rules that connect the package to the packages that triggered it's rebuild
+	QStringList origins;
+	for(const auto &trigger : triggers) {
+		for(const auto &rule : _controller->findRules(trigger)) {
+			if(rule.package == pkg && !origins.contains(rule.origin))
+				origins.append(rule.origin);
+		}
+	}
+	return origins;
+}
+
+QString PkgResolver::queueFile() const
+{
+	return QFileInfo{_settings->fileName()}.dir().absoluteFilePath(QStringLiteral("queue.log"));
+}
+
+bool PkgResolver::isDeferred() const
+{
+	return _settings->value(QStringLiteral("queue/deferred"), false).toBool();
+}
+
+void PkgResolver::setDeferred(bool deferred)
+{
+	if(!isRoot())
+		throw QStringLiteral("Must be run as root to change deferred evaluation!");
+	if(deferred)
+		_settings->setValue(QStringLiteral("queue/deferred"), true);
+	else {
+		_settings->remove(QStringLiteral("queue"));
+		processQueue();
+	}
+	qDebug() << (deferred ? "Enabled" : "Disabled") << "deferred evaluation via" << queueFile();
+}
+
+bool PkgResolver::hasQueue() const
+{
+	const auto path = queueFile();
+	return QFile::exists(path) || QFile::exists(path + QStringLiteral(".processing"));
+}
+
+void PkgResolver::enqueuePkgs(const QStringList &pkgs)
+{
+	if(!isRoot())
+		throw QStringLiteral("Must be run as root to update packages!");
+
+	// only the installed versions are needed, everything else happens once the queue is processed
+	transactionlog::Transaction transaction;
+	transaction.time = QDateTime::currentDateTimeUtc();
+	transaction.entries.reserve(pkgs.size());
+	for(const auto &pkg : pkgs) {
+		transactionlog::Entry entry;
+		entry.name = pkg.toUtf8();
+		entry.newVersion = _runner->readLocalVersion(pkg).toUtf8();
+		transaction.entries.append(entry);
+	}
+
+	// the queue may be moved away for processing between opening and locking it - then simply start a new one
+	const auto path = queueFile();
+	forever {
+		QFile file{path};
+		if(!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+			throw QStringLiteral("Failed to open queue %1 with error: %2")
+					.arg(path, file.errorString());
+		}
+		::flock(file.handle(), LOCK_EX);
+		struct stat fileStat, pathStat;
+		if(::fstat(file.handle(), &fileStat) == 0 &&
+		   ::stat(QFile::encodeName(path).constData(), &pathStat) == 0 &&
+		   fileStat.st_ino == pathStat.st_ino) {
+			transactionlog::append(file, transaction, true);
+			break;
+		}
+	}
+	qDebug() << "Queued" << pkgs.size() << "packages for deferred evaluation";
+}
+
+int PkgResolver::processQueue()
+{
+	if(!hasQueue())
+		return 0;
+	if(!isRoot())
+		throw QStringLiteral("Must be run as root to process the queue!");
+
+	const auto path = queueFile();
+	const auto processingPath = path + QStringLiteral(".processing");
+	QLockFile lock{path + QStringLiteral(".lock")};
+	if(!lock.lock())
+		throw QStringLiteral("Failed to lock the queue %1").arg(path);
+
+	// take the queue away from the hook - a left over one was interrupted and is processed again
+	if(!QFile::exists(processingPath)) {
+		QFile file{path};
+		if(!file.open(QIODevice::ReadOnly))
+			return 0;
+		::flock(file.handle(), LOCK_EX);
+		// a new queue has not been recorded yet
+		_settings->remove(QStringLiteral("transactions/queue"));
+		_settings->sync();
+		if(!QFile::rename(path, processingPath))
+			throw QStringLiteral("Failed to take the queue %1 for processing").arg(path);
+	}
+
+	QVector<transactionlog::Transaction> transactions;
+	transactionlog::read(processingPath, [&transactions](const transactionlog::Transaction &transaction) {
+		transactions.append(transaction);
+	});
+
+	pacmanlog::Position logPosition;
+	const auto changes = readLogChanges(logPosition);
+	// the transactions are not recorded again when an interrupted run is repeated
+	const auto record = isRecording() && !_settings->value(QStringLiteral("transactions/queue"), false).toBool();
+	const auto rules = ownerRules();
+	QVector<transactionlog::Transaction> records;
+	auto ownerInfos = readOwnerPkgs(rules);
+	QHash<QString, RuleStats> stats;
+	evaluateQueue(rules, transactions, changes, ownerInfos,
+				  [this](const QString &pkg, const QString &target, const QString &version) {
+					  return swapStoredVersion(pkg, target, version);
+				  },
+				  [this, rules, record, &records](const QStringList &pkgs, const QHash<QString, pacmanlog::Change> &txChanges, const QDateTime &time) {
+					  // stamped with the time the hook queued the transaction, not when it was processed
+					  if(record)
+						  records.append(createTransaction(rules, pkgs, txChanges, time));
+				  },
+				  &stats);
+
+	// the records are marked as written before the state, so a repeated run neither loses nor duplicates them
+	if(!records.isEmpty()) {
+		try {
+			QFile logFile{transactionLog()};
+			if(!logFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+				throw QStringLiteral("Failed to open transaction log %1 with error: %2")
+						.arg(logFile.fileName(), logFile.errorString());
+			}
+			for(auto i = 0; i < records.size(); i++)
+				transactionlog::append(logFile, records[i], i == records.size() - 1);
+			_settings->setValue(QStringLiteral("transactions/queue"), true);
+			_settings->sync();
+		} catch(QString &e) {
+			// recording must never break the evaluation
+			qWarning().noquote() << e;
+		}
+	}
+
+	// everything else is stored at once, so an interrupted run can simply be repeated
+	writeLogPosition(logPosition);
+	writeOwnerPkgs(ownerInfos);
+	writeRuleStats(stats);
+	_settings->sync();
+	QFile::remove(processingPath);
+	qDebug() << "Processed" << transactions.size() << "queued transactions";
+	return transactions.size();
+}
+
+QString PkgResolver::transactionLog() const
+{
+	return QFileInfo{_settings->fileName()}.dir().absoluteFilePath(QStringLiteral("transactions.log"));
+}
+
+bool PkgResolver::isRecording() const
+{
+	return _settings->value(QStringLiteral("transactions/record"), false).toBool();
+}
+
+void PkgResolver::setRecording(bool record)
+{
+	if(!isRoot())
+		throw QStringLiteral("Must be run as root to change transaction recording!");
+	if(record)
+		_settings->setValue(QStringLiteral("transactions/record"), true);
+	else
+		_settings->remove(QStringLiteral("transactions"));
+	qDebug() << (record ? "Enabled" : "Disabled") << "recording transactions to" << transactionLog();
+}
+
+QMap<QString, int> PkgResolver::replay(const QVector<transactionlog::Transaction> &transactions)
+{
+	// everything happens in memory, starting from an empty state
+	QHash<QString, QHash<QString, QString>> storedVersions; // package -> target -> version
+	QHash<QString, QString> latestVersions;
+	QMap<QString, int> counts;
+
+	for(const auto &transaction : transactions) {
+		QStringList pkgs;
+		QHash<QString, QString> newVersions;
+		QHash<QString, QString> oldVersions;
+		for(const auto &entry : transaction.entries) {
+			const auto name = QString::fromUtf8(entry.name);
+			pkgs.append(name);
+			newVersions.insert(name, QString::fromUtf8(entry.newVersion));
+			if(!entry.oldVersion.isEmpty())
+				oldVersions.insert(name, QString::fromUtf8(entry.oldVersion));
+		}
+
+		// every transaction counts the rebuilds it triggers on it's own, as if everything pending was rebuilt in between -
+		// the log only contains the real rebuilds of the current rules, which must not favour either rule set
+		PkgInfos pkgInfos;
+		evaluateUpdates(pkgs, pkgInfos,
+						[&](const QString &pkg) {
+							if(newVersions.contains(pkg))
+								return newVersions.value(pkg);
+							else if(latestVersions.contains(pkg))
+								return latestVersions.value(pkg);
+							else
+								return _runner->readLocalVersion(pkg);
+						},
+						[&](const QString &pkg, const QString &target, const QString &version) {
+							auto &stored = storedVersions[pkg][target];
+							auto oldVersion = stored;
+							// without any history, the version before the transaction is the baseline
+							if(oldVersion.isEmpty())
+								oldVersion = oldVersions.value(target, latestVersions.value(target, version));
+							stored = version;
+							return oldVersion;
+						});
+		for(auto it = pkgInfos.constBegin(); it != pkgInfos.constEnd(); it++)
+			counts[it.key()]++;
+
+		for(auto it = newVersions.constBegin(); it != newVersions.constEnd(); it++)
+			latestVersions.insert(it.key(), it.value());
+	}
+	return counts;
+}
+
+PkgResolver::PkgInfos PkgResolver::readPendingPkgs() const
+{
+	auto pkgInfos = readPkgs(_owner);
+	const auto path = queueFile();
+	QVector<transactionlog::Transaction> transactions;
+	for(const auto &queue : {path + QStringLiteral(".processing"), path}) {
+		if(!QFile::exists(queue))
+			continue;
+		try {
+			transactionlog::read(queue, [&transactions](const transactionlog::Transaction &transaction) {
+				transactions.append(transaction);
+			});
+		} catch(QString &e) {
+			qWarning().noquote() << e;
+		}
+	}
+	if(transactions.isEmpty())
+		return pkgInfos;
+
+	// evaluate the queue in memory, without touching the state - only root may process it
+	qDebug() << "Evaluating" << transactions.size() << "queued transactions";
+	pacmanlog::Position logPosition;
+	const auto changes = readLogChanges(logPosition);
+	QHash<QString, QHash<QString, QString>> storedVersions; // package -> target -> version
+	OwnerInfos ownerInfos{{_owner, pkgInfos}};
+	evaluateQueue(_controller, transactions, changes, ownerInfos,
+				  [this, &storedVersions](const QString &pkg, const QString &target, const QString &version) {
+					  auto &targets = storedVersions[pkg];
+					  const auto oldVersion = targets.contains(target) ? targets.value(target) : readStoredVersion(pkg, target);
+					  targets.insert(target, version);
+					  return oldVersion;
+				  });
+	return ownerInfos.value(_owner);
+}
+
+PkgResolver::PkgInfos PkgResolver::readPkgs(const QString &owner) const
+{
+	auto count = _settings->beginReadArray(ownerKey(owner, QStringLiteral("pkgstate")));
 	PkgInfos pkgs;
 	for(auto i = 0; i < count; i++) {
 		_settings->setArrayIndex(i);
@@ -152,11 +493,11 @@ PkgResolver::PkgInfos PkgResolver::readPkgs() const
 	return pkgs;
 }
 
-void PkgResolver::writePkgs(const PkgInfos &pkgInfos)
+void PkgResolver::writePkgs(const QString &owner, const PkgInfos &pkgInfos)
 {
 	auto keys = pkgInfos.keys();
-	_settings->remove(QStringLiteral("pkgstate"));
-	_settings->beginWriteArray(QStringLiteral("pkgstate"), pkgInfos.size());
+	_settings->remove(ownerKey(owner, QStringLiteral("pkgstate")));
+	_settings->beginWriteArray(ownerKey(owner, QStringLiteral("pkgstate")), pkgInfos.size());
 	for(auto i = 0; i < pkgInfos.size(); i++) {
 		_settings->setArrayIndex(i);
 		_settings->setValue(QStringLiteral("name"), keys[i]);
@@ -165,36 +506,429 @@ void PkgResolver::writePkgs(const PkgInfos &pkgInfos)
 	_settings->endArray();
 }
 
-bool PkgResolver::checkVersionUpdate(const RuleController::RuleInfo &pkgInfo, const QString &target)
+QString PkgResolver::ownerKey(const QString &owner, const QString &key)
+{
+	if(owner.isEmpty())
+		return key;
+	else
+		return QStringLiteral("users/%1/%2").arg(owner, key);
+}
+
+RuleController *PkgResolver::ownerRules()
+{
+	// as root, the rules of every user are evaluated in the same pass as the system rules
+	if(!_host || !isRoot())
+		return _controller;
+	if(!_ownerRules) {
+		const auto users = userRulePaths();
+		if(users.isEmpty())
+			return _controller;
+
+		const QList<std::pair<QDir, bool>> systemPaths {
+			{rootPath(), true},
+			{systemPath(), true},
+		};
+		QMap<QString, QList<std::pair<QDir, bool>>> ownerPaths;
+		ownerPaths.insert(QString{}, systemPaths);
+		for(const auto &user : users) {
+			auto paths = systemPaths;
+			paths.prepend(std::make_pair(user.second, false));
+			ownerPaths.insert(user.first, paths);
+			_users.append(user.first);
+		}
+		_ownerRules = new RuleController{_runner, this};
+		_ownerRules->setOwners(ownerPaths);
+	}
+	return _ownerRules;
+}
+
+PkgResolver::OwnerInfos PkgResolver::readOwnerPkgs(RuleController *rules)
+{
+	OwnerInfos ownerInfos;
+	const auto systemInfos = readPkgs(QString{});
+	ownerInfos.insert(QString{}, systemInfos);
+	if(rules != _ownerRules)
+		return ownerInfos;
+
+	// the triggers of a pending package that are connected to it by a rule of the owner
+	const auto ownedTriggers = [rules](const QString &owner, const QString &pkg, const QSet<QString> &triggers) {
+		QSet<QString> owned;
+		for(const auto &trigger : triggers) {
+			for(const auto &rule : rules->findRules(trigger)) {
+				if(rule.package == pkg && rule.owners.contains(owner)) {
+					owned.insert(trigger);
+					break;
+				}
+			}
+		}
+		return owned;
+	};
+
+	auto migrated = false;
+	for(const auto &user : qAsConst(_users)) {
+		if(_settings->contains(ownerKey(user, QStringLiteral("created")))) {
+			ownerInfos.insert(user, readPkgs(user));
+			continue;
+		}
+
+		// before their first pass, the rebuilds triggered by the rules of the user were pending for the system
+		PkgInfos pkgInfos;
+		for(auto it = systemInfos.constBegin(); it != systemInfos.constEnd(); it++) {
+			const auto triggers = ownedTriggers(user, it.key(), *it);
+			if(!triggers.isEmpty())
+				pkgInfos.insert(it.key(), triggers);
+		}
+		qDebug() << "Moved" << pkgInfos.size() << "pending packages to the state of" << user;
+		ownerInfos.insert(user, pkgInfos);
+		migrated = true;
+	}
+
+	// the system keeps only what it's own rules triggered
+	if(migrated) {
+		PkgInfos pkgInfos;
+		for(auto it = systemInfos.constBegin(); it != systemInfos.constEnd(); it++) {
+			const auto triggers = ownedTriggers(QString{}, it.key(), *it);
+			if(!triggers.isEmpty())
+				pkgInfos.insert(it.key(), triggers);
+		}
+		ownerInfos.insert(QString{}, pkgInfos);
+	}
+	return ownerInfos;
+}
+
+void PkgResolver::writeOwnerPkgs(const OwnerInfos &ownerInfos)
+{
+	for(auto it = ownerInfos.constBegin(); it != ownerInfos.constEnd(); it++) {
+		writePkgs(it.key(), *it);
+		// marks the section as taken over, even if nothing is pending for the user
+		if(!it.key().isEmpty() && !_settings->contains(ownerKey(it.key(), QStringLiteral("created"))))
+			_settings->setValue(ownerKey(it.key(), QStringLiteral("created")), QDateTime::currentDateTimeUtc());
+	}
+}
+
+QString PkgResolver::swapStoredVersion(const QString &pkg, const QString &target, const QString &version)
 {
-	auto newVersion = _runner->readPackageVersion(target);
+	_settings->beginGroup(QStringLiteral("versions"));
+	_settings->beginGroup(pkg);
+	auto oldVersion = _settings->value(target).toString();
+	_settings->setValue(target, version);
+	_settings->endGroup();
+	_settings->endGroup();
+	return oldVersion;
+}
 
+QString PkgResolver::readStoredVersion(const QString &pkg, const QString &target) const
+{
 	_settings->beginGroup(QStringLiteral("versions"));
-	_settings->beginGroup(pkgInfo.package);
+	_settings->beginGroup(pkg);
 	auto oldVersion = _settings->value(target).toString();
-	_settings->setValue(target, newVersion);
 	_settings->endGroup();
 	_settings->endGroup();
+	return oldVersion;
+}
+
+void PkgResolver::writeRuleStats(const QHash<QString, RuleStats> &stats)
+{
+	_settings->beginGroup(QStringLiteral("rulestats"));
+	for(auto it = stats.constBegin(); it != stats.constEnd(); it++) {
+		_settings->beginGroup(it.key());
+		_settings->setValue(QStringLiteral("evaluations"), _settings->value(QStringLiteral("evaluations"), 0).toULongLong() + it->evaluations);
+		_settings->setValue(QStringLiteral("triggers"), _settings->value(QStringLiteral("triggers"), 0).toULongLong() + it->triggers);
+		_settings->setValue(QStringLiteral("skips"), _settings->value(QStringLiteral("skips"), 0).toULongLong() + it->skips);
+		_settings->endGroup();
+	}
+	_settings->endGroup();
+}
+
+QHash<QString, pacmanlog::Change> PkgResolver::readLogChanges(pacmanlog::Position &position) const
+{
+	// continue where the last run stopped - the very first run reads the whole log once,
+	// but only the most recent change of each package is relevant then
+	const auto logFile = _runner->logFile();
+	position.offset = _settings->value(QStringLiteral("pacmanlog/offset"), 0).toLongLong();
+	position.fileId = _settings->value(QStringLiteral("pacmanlog/fileid")).toByteArray();
+	const auto bootstrap = _settings->value(QStringLiteral("pacmanlog/file")).toString() != logFile;
+	if(bootstrap)
+		position = pacmanlog::Position{};
+
+	try {
+		return pacmanlog::readChanges(logFile, position, bootstrap);
+	} catch(QString &e) {
+		// without the log, the versions are queried from pacman as before
+		qWarning().noquote() << e;
+		position.offset = -1;
+		return {};
+	}
+}
 
-	if(oldVersion.isEmpty())
-		return true;
+void PkgResolver::writeLogPosition(const pacmanlog::Position &position)
+{
+	if(position.offset < 0)
+		return;
+	_settings->setValue(QStringLiteral("pacmanlog/file"), _runner->logFile());
+	_settings->setValue(QStringLiteral("pacmanlog/offset"), position.offset);
+	_settings->setValue(QStringLiteral("pacmanlog/fileid"), position.fileId);
+}
 
-	// apply filter rule to determine if the version changed
-	// first: filter both versions
-	if(pkgInfo.range) {
-		oldVersion = oldVersion.mid(pkgInfo.range->first, pkgInfo.range->second.value_or(-1));
-		newVersion = newVersion.mid(pkgInfo.range->first, pkgInfo.range->second.value_or(-1));
+void PkgResolver::evaluateQueue(RuleController *rules,
+								const QVector<transactionlog::Transaction> &transactions,
+								const QHash<QString, pacmanlog::Change> &changes,
+								OwnerInfos &ownerInfos,
+								const VersionSwap &swapVersion,
+								const std::function<void(const QStringList &, const QHash<QString, pacmanlog::Change> &, const QDateTime &)> &record,
+								QHash<QString, RuleStats> *stats) const
+{
+	// the versions every package had over the course of the queued transactions
+	QHash<QString, QVector<std::pair<int, QString>>> histories; // package -> (transaction, new version)
+	for(auto i = 0; i < transactions.size(); i++) {
+		for(const auto &entry : transactions[i].entries)
+			histories[QString::fromUtf8(entry.name)].append(std::make_pair(i, QString::fromUtf8(entry.newVersion)));
 	}
-	// second: for any-compares, do so without further processing
-	if(pkgInfo.scope == RuleController::RuleScope::Any)
-		return oldVersion != newVersion;
-	// third: split the version and compare based on scope
+	const auto versionAt = [&](const QString &pkg, int index) -> QString {
+		const auto history = histories.value(pkg);
+		if(history.isEmpty())
+			return _runner->readLocalVersion(pkg);
+		QString version;
+		for(const auto &step : history) {
+			if(step.first > index)
+				break;
+			version = step.second;
+		}
+		// before it's first queued upgrade, the package had the version it was upgraded from
+		return version.isNull() ? changes.value(pkg).oldVersion : version;
+	};
+
+	// each transaction is evaluated on it's own, exactly like the hook would have done
+	for(auto i = 0; i < transactions.size(); i++) {
+		QStringList pkgs;
+		QHash<QString, pacmanlog::Change> txChanges;
+		for(const auto &entry : transactions[i].entries) {
+			const auto pkg = QString::fromUtf8(entry.name);
+			pkgs.append(pkg);
+			txChanges.insert(pkg, pacmanlog::Change{versionAt(pkg, i - 1), QString::fromUtf8(entry.newVersion)});
+		}
+		if(record)
+			record(pkgs, txChanges, transactions[i].time);
+		evaluateUpdates(rules, pkgs, ownerInfos,
+						[&](const QString &pkg) {
+							return versionAt(pkg, i);
+						},
+						[&](const QString &pkg, const QString &target, const QString &version) {
+							const auto oldVersion = swapVersion(pkg, target, version);
+							return oldVersion.isEmpty() ? txChanges.value(target).oldVersion : oldVersion;
+						},
+						stats);
+	}
+}
+
+void PkgResolver::recordTransaction(RuleController *rules, const QStringList &pkgs, const QHash<QString, pacmanlog::Change> &changes)
+{
+	try {
+		transactionlog::append(transactionLog(), createTransaction(rules, pkgs, changes, QDateTime::currentDateTimeUtc()));
+	} catch(QString &e) {
+		// recording must never break the hook
+		qWarning().noquote() << e;
+	}
+}
+
+transactionlog::Transaction PkgResolver::createTransaction(RuleController *rules, const QStringList &pkgs, const QHash<QString, pacmanlog::Change> &changes) const
+{
+	transactionlog::Transaction transaction;
+	transaction.time = time;
+	transaction.entries.reserve(pkgs.size());
+	for(const auto &pkg : pkgs) {
+		transactionlog::Entry entry;
+		entry.name = pkg.toUtf8();
+		const auto change = changes.value(pkg);
+		if(!change.newVersion.isEmpty()) {
+			entry.oldVersion = change.oldVersion.toUtf8();
+			entry.newVersion = change.newVersion.toUtf8();
+			transaction.entries.append(entry);
+			continue;
+		}
+
+		entry.newVersion = _runner->readLocalVersion(pkg).toUtf8();
+		// the installed version is already replaced, but the rules remember the previous one
+		for(const auto &rule : rules->findRules(pkg)) {
+			const auto oldVersion = readStoredVersion(rule.package, pkg);
+			if(!oldVersion.isEmpty()) {
+				entry.oldVersion = oldVersion.toUtf8();
+				break;
+			}
+		}
+		transaction.entries.append(entry);
+	}
+	return transaction;
+}
+
+void PkgResolver::evaluateUpdates(const QStringList &pkgs, PkgInfos &pkgInfos, const VersionLookup &readVersion, const VersionSwap &swapVersion) const
+{
+	OwnerInfos ownerInfos{{QString{}, pkgInfos}};
+	evaluateUpdates(_controller, pkgs, ownerInfos, readVersion, swapVersion);
+	pkgInfos = ownerInfos.value(QString{});
+}
+
+void PkgResolver::evaluateUpdates(RuleController *rules, const QStringList &pkgs, OwnerInfos &ownerInfos, const VersionLookup &readVersion, const VersionSwap &swapVersion, QHash<QString, RuleStats> *stats) const
+{
+	// every package is evaluated for the owners whose rules reached it
+	QQueue<std::pair<QString, QSet<QString>>> pkgQueue;
+	const auto allOwners = QSet<QString>::fromList(ownerInfos.keys());
+	for(const auto& pkg : pkgs)
+		pkgQueue.enqueue(std::make_pair(pkg, allOwners));
+
+	QHash<QString, QSet<QString>> handledOwners;
+	QHash<QString, QString> newVersions;
+	QHash<QString, QString> oldVersions; // "<package>\n<target>" -> version the rules last saw
+
+	while (!pkgQueue.isEmpty()) {
+		//handle each package only once per owner
+		const auto entry = pkgQueue.dequeue();
+		const auto &pkg = entry.first;
+		auto &handled = handledOwners[pkg];
+		const auto previous = handled;
+		const auto owners = entry.second - handled;
+		if(owners.isEmpty())
+			continue;
+		handled += owners;
+
+		//check if packages need updates
+		const auto matches = rules->findRules(pkg);
+		if(matches.isEmpty())
+			continue;
+
+		//group the rules by filter and the version they last saw, so each distinct comparison is only done once
+		struct RuleGroup {
+			VersionFilter filter;
+			QString oldVersion;
+			QList<std::pair<RuleController::RuleInfo, QSet<QString>>> rules; // (rule, owners)
+		};
+		auto newVersion = newVersions.value(pkg);
+		if(!newVersions.contains(pkg)) {
+			newVersion = readVersion(pkg);
+			newVersions.insert(pkg, newVersion);
+		}
+		QVector<RuleGroup> groups;
+		for(const auto& match : matches) {
+			const auto ruleOwners = match.owners.isEmpty() ? owners : match.owners & owners;
+			if(ruleOwners.isEmpty())
+				continue;
+			const VersionFilter filter{match};
+			// rules of different owners may share the same package, but the version is only replaced once
+			const auto versionKey = match.package + QLatin1Char('\n') + pkg;
+			auto oldVersion = oldVersions.constFind(versionKey);
+			if(oldVersion == oldVersions.constEnd())
+				oldVersion = oldVersions.insert(versionKey, swapVersion(match.package, pkg, newVersion));
+			auto group = std::find_if(groups.begin(), groups.end(), [&](const RuleGroup &other) {
+				return other.filter == filter && other.oldVersion == *oldVersion;
+			});
+			if(group == groups.end())
+				groups.append(RuleGroup{filter, *oldVersion, {std::make_pair(match, ruleOwners)}});
+			else
+				group->rules.append(std::make_pair(match, ruleOwners));
+		}
+
+		//add those to the "needs updates" list
+		//and check if they themselves will trigger rebuilds by adding them to the queue
+		for(const auto &group : qAsConst(groups)) {
+			const auto changed = group.oldVersion.isEmpty() || group.filter.changed(group.oldVersion, newVersion);
+			for(const auto &ruleEntry : group.rules) {
+				const auto &rule = ruleEntry.first;
+				const auto &target = rule.package;
+				// a rule reached again for more owners was already counted
+				if(stats && (rule.owners.isEmpty() ? previous : rule.owners & previous).isEmpty()) {
+					auto &ruleStats = (*stats)[rule.origin];
+					ruleStats.evaluations++;
+					if(changed)
+						ruleStats.triggers++;
+					else
+						ruleStats.skips++;
+				}
+				if(changed) {
+					for(const auto &owner : ruleEntry.second)
+						ownerInfos[owner][target].insert(pkg);
+					pkgQueue.enqueue(std::make_pair(target, ruleEntry.second));
+					qDebug() << "Rule triggered. Marked"
+							 << target
+							 << "for updates because of"
+							 << pkg;
+				} else {
+					qDebug() << "Rule skipped. Did not mark "
+							 << target
+							 << "for updates because version of"
+							 << pkg
+							 << "did not change significantly";
+				}
+			}
+		}
+	}
+
+	//remove all "original" packages from the rebuild list as they have just been built
+	for(auto &pkgInfos : ownerInfos) {
+		for(const auto& pkg : pkgs)
+			pkgInfos.remove(pkg);
+	}
+}
+
+PkgResolver::VersionFilter::VersionFilter(const RuleController::RuleInfo &rule) :
+	_scope{rule.scope},
+	_count{rule.count}
+{
+	if(rule.range) {
+		_offset = rule.range->first;
+		_limit = rule.range->second.value_or(-1);
+	}
+
+	// pick the cheapest comparison that is still correct for the filter
+	const auto ranged = rule.range.has_value();
+	if(_scope == RuleController::RuleScope::Any)
+		_compare = ranged ? &VersionFilter::compareAnyRanged : &VersionFilter::compareAny;
+	else
+		_compare = ranged ? &VersionFilter::compareScopedRanged : &VersionFilter::compareScoped;
+}
+
+bool PkgResolver::VersionFilter::changed(const QString &oldVersion, const QString &newVersion) const
+{
+	return _compare(*this, oldVersion, newVersion);
+}
+
+bool PkgResolver::VersionFilter::operator==(const VersionFilter &other) const
+{
+	return _scope == other._scope &&
+			_offset == other._offset &&
+			_limit == other._limit &&
+			_count == other._count &&
+			_compare == other._compare;
+}
+
+bool PkgResolver::VersionFilter::compareAny(const VersionFilter &, const QString &oldVersion, const QString &newVersion)
+{
+	return oldVersion != newVersion;
+}
+
+bool PkgResolver::VersionFilter::compareAnyRanged(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion)
+{
+	return oldVersion.midRef(filter._offset, filter._limit) != newVersion.midRef(filter._offset, filter._limit);
+}
+
+bool PkgResolver::VersionFilter::compareScoped(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion)
+{
+	return filter.compareTuples(oldVersion, newVersion);
+}
+
+bool PkgResolver::VersionFilter::compareScopedRanged(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion)
+{
+	return filter.compareTuples(oldVersion.mid(filter._offset, filter._limit), newVersion.mid(filter._offset, filter._limit));
+}
+
+bool PkgResolver::VersionFilter::compareTuples(const QString &oldVersion, const QString &newVersion) const
+{
+	// split the version and compare based on scope
 	auto ok = true;
 	const auto oldVTuple = splitVersion(oldVersion, ok);
 	const auto newVTuple = splitVersion(newVersion, ok);
 	if(!ok)
 		return oldVersion != newVersion;
-	switch (pkgInfo.scope) {
+	switch (_scope) {
 	case RuleController::RuleScope::Revision:
 		if(oldVTuple.revision != newVTuple.revision)
 			return true;
@@ -204,9 +938,9 @@ bool PkgResolver::checkVersionUpdate(const RuleController::RuleInfo &pkgInfo, co
 			return true;
 		Q_FALLTHROUGH();
 	case RuleController::RuleScope::Version:
-		if(pkgInfo.count) {
-			if(oldVTuple.version.segments().mid(0, *pkgInfo.count) !=
-			   newVTuple.version.segments().mid(0, *pkgInfo.count))
+		if(_count) {
+			if(oldVTuple.version.segments().mid(0, *_count) !=
+			   newVTuple.version.segments().mid(0, *_count))
 				return true;
 		} else {
 			if(oldVTuple.version != newVTuple.version)
@@ -221,6 +955,94 @@ bool PkgResolver::checkVersionUpdate(const RuleController::RuleInfo &pkgInfo, co
 	}
 }
 
+QHash<QString, QString> PkgResolver::readPkgBases(const QStringList &pkgs) const
+{
+	QHash<QString, QString> pkgBases;
+	for(const auto &pkg : pkgs)
+		pkgBases.insert(pkg, _runner->readPackageBase(pkg));
+	return pkgBases;
+}
+
+QString PkgResolver::formatDetail(const PkgInfos &pkgInfos, const QHash<QString, QString> &pkgBases, const QHash<QString, QString> &upstreamUpdates)
+{
+	// the upstream column is only shown if there is anything to report
+	const auto withUpstream = !upstreamUpdates.isEmpty();
+	QStringList pkgs;
+	auto header = QStringLiteral("%1| %2| ")
+				  .arg(QStringLiteral(" Package Update"), -30)
+				  .arg(QStringLiteral("Built from"), -20);
+	auto separator = QStringLiteral("-").repeated(30) + QLatin1Char('|') +
+					 QStringLiteral("-").repeated(21) + QLatin1Char('|');
+	if(withUpstream) {
+		header += QStringLiteral("%1| ").arg(QStringLiteral("Upgrades to"), -20);
+		separator += QStringLiteral("-").repeated(21) + QLatin1Char('|');
+	}
+	pkgs.append(header + QStringLiteral("Triggered by"));
+	pkgs.append(separator + QStringLiteral("-").repeated(27));
+
+	for(auto it = pkgInfos.constBegin(); it != pkgInfos.constEnd(); it++) {
+		auto lst = it.value().toList();
+		std::sort(lst.begin(), lst.end());
+		auto line = QStringLiteral("%1| %2| ")
+					.arg(it.key(), -30)
+					.arg(pkgBases.value(it.key(), it.key()), -20);
+		if(withUpstream)
+			line += QStringLiteral("%1| ").arg(upstreamUpdates.value(it.key()), -20);
+		pkgs.append(line + lst.join(QStringLiteral(", ")));
+	}
+	return pkgs.join(QLatin1Char('\n'));
+}
+
+QList<QStringList> PkgResolver::calcWaves(const PkgInfos &pkgInfos, const QHash<QString, QString> &pkgBases)
+{
+	// plan one build per pkgbase: merge the triggers of all split packages,
+	// dropping the ones between siblings, as they are built together anyways
+	const auto baseOf = [&pkgBases](const QString &pkg) {
+		return pkgBases.value(pkg, pkg);
+	};
+	const auto groups = groupByBase(pkgInfos.keys(), pkgBases);
+	PkgInfos pkgs;
+	for(auto it = pkgInfos.constBegin(); it != pkgInfos.constEnd(); it++) {
+		auto &triggers = pkgs[baseOf(it.key())];
+		for(const auto &trigger : it.value()) {
+			if(pkgInfos.contains(trigger))
+				triggers.insert(baseOf(trigger));
+		}
+		triggers.remove(baseOf(it.key()));
+	}
+
+	QList<QStringList> waves;
+	while(!pkgs.isEmpty()) {
+		//find all packages that dont have a trigger that needs to be rebuild as well
+		const auto keys = QSet<QString>::fromList(pkgs.keys());
+		QStringList wave;
+		for(auto it = pkgs.begin(); it != pkgs.end();) {
+			if(keys.intersects(it.value()))
+				it++; //has a trigger dep, postpone for later
+			else {
+				wave.append(groups.value(it.key()));
+				it = pkgs.erase(it);
+			}
+		}
+		if(wave.isEmpty()) {
+			throw QStringLiteral("Cyclic dependencies detected! Is within packages: %1")
+					.arg(keys.toList().join(QLatin1Char(' ')));
+		}
+		waves.append(wave);
+		qDebug() << "Calculated wave:" << wave.join(QLatin1Char(' '));
+	}
+
+	return waves;
+}
+
+QMap<QString, QStringList> PkgResolver::groupByBase(const QStringList &pkgs, const QHash<QString, QString> &pkgBases)
+{
+	QMap<QString, QStringList> groups;
+	for(const auto &pkg : pkgs)
+		groups[pkgBases.value(pkg, pkg)].append(pkg);
+	return groups;
+}
+
 PkgResolver::VersionTuple PkgResolver::splitVersion(const QString &version, bool &ok)
 {
 	static const QRegularExpression regex{QStringLiteral(R"__(^(?:(\d+):)?(.*)-([\d\.]+)$)__")};
@@ -3,25 +3,70 @@
 
 #include "pacmanrunner.h"
 #include "rulecontroller.h"
+#include "global.h"
+#include "transactionlog.h"
+#include "pacmanlog.h"
 
 #include <QObject>
 #include <QSettings>
 #include <QVersionNumber>
+#include <functional>
 
 class PkgResolver : public QObject
 {
 	Q_OBJECT
 
 public:
+	using PkgInfos = QMap<QString, QSet<QString>>; //package -> triggered by
+	using OwnerInfos = QHash<QString, PkgInfos>; // owner -> pending packages
+	using VersionLookup = std::function<QString(const QString &)>; // package -> current version
+	using VersionSwap = std::function<QString(const QString &, const QString &, const QString &)>; // (package, target, new version) -> old version
+
+	struct RuleStats {
+		quint64 evaluations = 0;
+		quint64 triggers = 0;
+		quint64 skips = 0; // evaluated, but the filter did not see a significant change
+	};
+
 	explicit PkgResolver(PacmanRunner *runner, RuleController *controller, QObject *parent = nullptr);
+	explicit PkgResolver(const global::RootConfig &root, PacmanRunner *runner, RuleController *controller, QObject *parent = nullptr);
 
 	QStringList listPkgs() const;
 	QString listDetailPkgs() const;
 	QList<QStringList> listPkgWaves() const;
+	QList<QStringList> listPkgWaves(const QStringList &targets) const;
+	PkgInfos listPkgInfos() const;
+	PkgInfos listEvaluatedPkgInfos() const; // without the queued transactions
 
+	void reload();
 	void updatePkgs(const QStringList &pkgs);
+	PkgInfos predictPkgs();
 	void clear(const QStringList &pkgs);
 
+	QString queueFile() const;
+	bool isDeferred() const;
+	void setDeferred(bool deferred);
+	bool hasQueue() const;
+	void enqueuePkgs(const QStringList &pkgs);
+	int processQueue(); // -> number of processed transactions
+
+	QString transactionLog() const;
+	bool isRecording() const;
+	void setRecording(bool record);
+	QMap<QString, int> replay(const QVector<transactionlog::Transaction> &transactions); // package -> rebuild count
+
+	QString owner() const; // the user whose pending packages are used, empty for the system
+
+	QHash<QString, QString> readPkgBases(const QStringList &pkgs) const;
+	QHash<QString, RuleStats> readRuleStats() const; // rule origin -> stats
+	QStringList findRuleOrigins(const QString &pkg, const QSet<QString> &triggers) const;
+
+	static QString formatDetail(const PkgInfos &pkgInfos,
+								const QHash<QString, QString> &pkgBases = {},
+								const QHash<QString, QString> &upstreamUpdates = {});
+	static QList<QStringList> calcWaves(const PkgInfos &pkgInfos, const QHash<QString, QString> &pkgBases = {});
+	static QMap<QString, QStringList> groupByBase(const QStringList &pkgs, const QHash<QString, QString> &pkgBases);
+
 private:
 	struct VersionTuple {
 		int epoche = 0;
@@ -29,18 +74,69 @@ private:
 		QString suffix;
 		QVersionNumber revision;
 	};
-	using PkgInfos = QMap<QString, QSet<QString>>; //package -> triggered by
-
 	QSettings *_settings;
 	PacmanRunner *_runner;
 	RuleController *_controller;
+	bool _host = false;
+	QString _owner;
+	RuleController *_ownerRules = nullptr;
+	QStringList _users;
 
-	PkgInfos readPkgs() const;
-	void writePkgs(const PkgInfos &pkgInfos);
+	PkgInfos readPendingPkgs() const;
+	PkgInfos readPkgs(const QString &owner) const;
+	void writePkgs(const QString &owner, const PkgInfos &pkgInfos);
 
 	QString readVersion();
 
-	bool checkVersionUpdate(const RuleController::RuleInfo &pkgInfo, const QString &target);
+	static QString ownerKey(const QString &owner, const QString &key);
+	RuleController *ownerRules();
+	OwnerInfos readOwnerPkgs(RuleController *rules);
+	void writeOwnerPkgs(const OwnerInfos &ownerInfos);
+
+	QString swapStoredVersion(const QString &pkg, const QString &target, const QString &version);
+	QString readStoredVersion(const QString &pkg, const QString &target) const;
+	void writeRuleStats(const QHash<QString, RuleStats> &stats);
+	QHash<QString, pacmanlog::Change> readLogChanges(pacmanlog::Position &position) const;
+	void writeLogPosition(const pacmanlog::Position &position);
+	void recordTransaction(RuleController *rules, const QStringList &pkgs, const QHash<QString, pacmanlog::Change> &changes);
+	transactionlog::Transaction createTransaction(RuleController *rules, const QStringList &pkgs, const QHash<QString, pacmanlog::Change> &changes, const QDateTime &time) const;
+
+	// the filter of a rule, compiled into a comparison specialized for it's scope and range
+	class VersionFilter {
+	public:
+		explicit VersionFilter(const RuleController::RuleInfo &rule);
+
+		bool changed(const QString &oldVersion, const QString &newVersion) const;
+		bool operator==(const VersionFilter &other) const;
+
+	private:
+		using Compare = bool (*)(const VersionFilter &, const QString &, const QString &);
+
+		RuleController::RuleScope _scope;
+		int _offset = 0;
+		int _limit = -1; // -1 for everything after the offset
+		std::optional<int> _count;
+		Compare _compare;
+
+		static bool compareAny(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion);
+		static bool compareAnyRanged(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion);
+		static bool compareScoped(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion);
+		static bool compareScopedRanged(const VersionFilter &filter, const QString &oldVersion, const QString &newVersion);
+		bool compareTuples(const QString &oldVersion, const QString &newVersion) const;
+	};
+
+	void evaluateUpdates(const QStringList &pkgs, PkgInfos &pkgInfos,
+						 const VersionLookup &readVersion, const VersionSwap &swapVersion) const;
+	void evaluateUpdates(RuleController *rules, const QStringList &pkgs, OwnerInfos &ownerInfos,
+						 const VersionLookup &readVersion, const VersionSwap &swapVersion,
+						 QHash<QString, RuleStats> *stats = nullptr) const;
+	void evaluateQueue(RuleController *rules,
+					   const QVector<transactionlog::Transaction> &transactions,
+					   const QHash<QString, pacmanlog::Change> &changes,
+					   OwnerInfos &ownerInfos,
+					   const VersionSwap &swapVersion,
+					   const std::function<void(const QStringList &, const QHash<QString, pacmanlog::Change> &, const QDateTime &)> &record = {},
+					   QHash<QString, RuleStats> *stats = nullptr) const;
 	static VersionTuple splitVersion(const QString &version, bool &ok);
 };
 
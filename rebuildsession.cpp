@@ -0,0 +1,464 @@
+#include "rebuildsession.h"
+#include "sourceprefetcher.h"
+#include "pkgdb.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+#include <QStandardPaths>
+
+RebuildSession::RebuildSession(PacmanRunner *runner, PkgResolver *resolver, QObject *parent) :
+	QObject{parent},
+	_runner{runner},
+	_resolver{resolver},
+	_journal{new QSettings{
+		QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QStringLiteral("/session.conf"),
+		QSettings::IniFormat,
+		this
+	}},
+	_admission{new AdmissionControl{this}},
+	_profile{new BuildProfile{runner, this}},
+	_upstream{new UpstreamSource{runner, this}},
+	_chroot{new ChrootBuilder{runner, this}}
+{}
+
+int RebuildSession::run(const QList<QStringList> &waves, bool earlyCutoff)
+{
+	if(waves.isEmpty()) {
+		qWarning() << "No packages need to be rebuilt";
+		return EXIT_SUCCESS;
+	}
+
+	QStringList pkgs;
+	for(const auto &wave : waves)
+		pkgs.append(wave);
+	_runner->checkInstalled(pkgs);
+
+	// start a fresh session
+	_done.clear();
+	_failed.clear();
+	_skipped.clear();
+	_unchanged.clear();
+	_earlyCutoff = earlyCutoff;
+	_journal->remove(QStringLiteral("session"));
+	_journal->setValue(QStringLiteral("session/packages"), pkgs);
+	_journal->setValue(QStringLiteral("session/cutoff"), earlyCutoff);
+	checkpoint();
+
+	return runWaves(waves);
+}
+
+int RebuildSession::resume()
+{
+	const auto pkgs = _journal->value(QStringLiteral("session/packages")).toStringList();
+	if(pkgs.isEmpty())
+		throw QStringLiteral("There is no rebuild session to be resumed");
+
+	// failed and skipped packages are tried again, completed ones are not
+	_done = readJournal(QStringLiteral("done"));
+	_failed.clear();
+	_skipped.clear();
+	_unchanged.clear();
+	_earlyCutoff = _journal->value(QStringLiteral("session/cutoff"), false).toBool();
+	const auto pending = QSet<QString>::fromList(_resolver->listPkgs());
+	QStringList todo;
+	for(const auto &pkg : pkgs) {
+		if(!_done.contains(pkg) && pending.contains(pkg))
+			todo.append(pkg);
+	}
+	if(todo.isEmpty()) {
+		qInfo() << "All packages of the rebuild session have already been rebuilt";
+		_journal->remove(QStringLiteral("session"));
+		return EXIT_SUCCESS;
+	}
+
+	qDebug() << "Resuming rebuild session with" << todo.size() << "of" << pkgs.size() << "packages left";
+	_runner->checkInstalled(todo);
+	return runWaves(_resolver->listPkgWaves(todo));
+}
+
+int RebuildSession::runWaves(const QList<QStringList> &waves)
+{
+	// download the sources of all packages in the background, while the earlier waves are built
+	QScopedPointer<SourcePrefetcher> prefetcher;
+	const auto remote = _runner->prefetchRemote();
+	if(!remote.isEmpty()) {
+		prefetcher.reset(new SourcePrefetcher{remote});
+		QList<std::pair<QString, QString>> prefetchPkgs;
+		for(const auto &wave : waves) {
+			for(const auto &pkg : wave)
+				prefetchPkgs.append(std::make_pair(pkg, _runner->readPackageBase(pkg)));
+		}
+		prefetcher->start(prefetchPkgs);
+		// makepkg picks up the prefetched sources via SRCDEST
+		qputenv("SRCDEST", QFile::encodeName(prefetcher->sourceDir()));
+	}
+
+	_pkgInfos = _resolver->listPkgInfos();
+	const auto &pkgInfos = _pkgInfos;
+	QSet<QString> open;
+	for(const auto &wave : waves)
+		open.unite(QSet<QString>::fromList(wave));
+
+	// AUR helpers and the prefetched repositories build the latest sources, so pending upstream updates are included in the rebuild
+	try {
+		_upgrades = _upstream->readUpdates(open.toList());
+		if(!_upgrades.isEmpty() && _runner->batchDestination().isEmpty() &&
+		   QFileInfo{std::get<0>(_runner->frontend()).value(0)}.fileName() == QStringLiteral("pacman")) {
+			qWarning() << "pacman only reinstalls the repository versions, pending upstream updates are not built";
+			_upgrades.clear();
+		}
+		for(auto it = _upgrades.constBegin(); it != _upgrades.constEnd(); it++)
+			qInfo().noquote() << "Upgrading" << it.key() << "to" << it.value() << "with the rebuild";
+	} catch(QString &e) {
+		qWarning().noquote() << "Unable to check for upstream updates:" << e;
+		_upgrades.clear();
+	}
+
+	const auto pkgDest = _runner->batchDestination();
+	if(!pkgDest.isEmpty() && !prefetcher)
+		throw QStringLiteral("Batched installation builds from the prefetched repositories, configure them via `repkg frontend --prefetch`");
+	if(!ChrootBuilder::directory().isEmpty()) {
+		if(pkgDest.isEmpty())
+			throw QStringLiteral("Clean chroot builds are only supported with batched installation, configure it via `repkg frontend --batch`");
+		_chroot->prepare();
+	}
+
+	if(pkgDest.isEmpty() && !std::get<1>(_runner->frontend())) {
+		// all packages are built by a single call, so everything must be there and nothing can be journaled
+		QStringList pkgs;
+		for(const auto &wave : waves)
+			pkgs.append(wave);
+		pkgs = substitute(pkgs, pkgInfos, open);
+		if(pkgs.isEmpty()) {
+			_journal->remove(QStringLiteral("session"));
+			return EXIT_SUCCESS;
+		}
+		if(prefetcher)
+			prefetcher->waitFor(pkgs);
+		_journal->remove(QStringLiteral("session"));
+		_journal->sync();
+		// the tuned build directories must be measured and removed afterwards, which an exec would skip
+		if(BuildProfile::isEnabled())
+			return runFrontend(pkgs) == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+		_runner->execFrontend(pkgs);
+	}
+
+	for(const auto &wave : waves) {
+		// skip everything that depends on a package that could not be rebuilt
+		QStringList pkgs;
+		for(const auto &pkg : wave) {
+			const auto triggers = pkgInfos.value(pkg);
+			if(_done.contains(pkg))
+				continue; // was cut off by an earlier wave
+			else if(triggers.intersects(_failed) || triggers.intersects(_skipped)) {
+				qWarning() << "Skipping" << pkg << "because one of it's dependencies failed to rebuild";
+				_skipped.insert(pkg);
+			} else
+				pkgs.append(pkg);
+		}
+		pkgs = substitute(pkgs, pkgInfos, open);
+		open.subtract(QSet<QString>::fromList(wave));
+		if(pkgs.isEmpty()) {
+			checkpoint();
+			continue;
+		}
+
+		if(prefetcher)
+			prefetcher->waitFor(pkgs);
+		QHash<QString, QByteArray> fingerprints;
+		if(_earlyCutoff) {
+			for(const auto &pkg : qAsConst(pkgs))
+				fingerprints.insert(pkg, _runner->readFileFingerprint(pkg));
+		}
+		if(!pkgDest.isEmpty())
+			buildBatch(pkgs, prefetcher.data(), pkgDest);
+		else if(runFrontend(pkgs) == EXIT_SUCCESS) {
+			for(const auto &pkg : qAsConst(pkgs))
+				markDone(pkg);
+		} else {
+			// the hook already removed all successfully rebuilt packages from the pending ones,
+			// the rest is retried one pkgbase at a time to find the ones that actually fail
+			_resolver->reload();
+			const auto pending = QSet<QString>::fromList(_resolver->listPkgs());
+			const auto groups = PkgResolver::groupByBase(pkgs, _resolver->readPkgBases(pkgs));
+			for(const auto &group : groups) {
+				QStringList retryPkgs;
+				for(const auto &pkg : group) {
+					if(pending.contains(pkg))
+						retryPkgs.append(pkg);
+					else
+						markDone(pkg);
+				}
+				if(retryPkgs.isEmpty())
+					continue;
+
+				const auto ok = groups.size() > 1 && runFrontend(retryPkgs) == EXIT_SUCCESS;
+				for(const auto &pkg : qAsConst(retryPkgs)) {
+					if(ok)
+						markDone(pkg);
+					else {
+						qWarning() << "Failed to rebuild" << pkg;
+						_failed.insert(pkg);
+					}
+				}
+			}
+		}
+		if(_earlyCutoff)
+			cutOff(fingerprints, pkgInfos);
+		checkpoint();
+	}
+
+	if(_failed.isEmpty() && _skipped.isEmpty()) {
+		_journal->remove(QStringLiteral("session"));
+		return EXIT_SUCCESS;
+	} else {
+		auto failed = _failed.toList();
+		std::sort(failed.begin(), failed.end());
+		auto skipped = _skipped.toList();
+		std::sort(skipped.begin(), skipped.end());
+		qCritical().noquote() << "Failed to rebuild:" << failed.join(QLatin1Char(' '));
+		if(!skipped.isEmpty())
+			qCritical().noquote() << "Skipped because of failed dependencies:" << skipped.join(QLatin1Char(' '));
+		qCritical() << "Fix the problems and run `repkg rebuild --resume` to continue the session";
+		return EXIT_FAILURE;
+	}
+}
+
+int RebuildSession::runFrontend(const QStringList &pkgs)
+{
+	const auto admission = _admission->isEnabled() ? _admission : nullptr;
+	if(admission)
+		admission->admit(pkgs);
+	const auto tuned = BuildProfile::isEnabled();
+	QElapsedTimer timer;
+	timer.start();
+	const auto result = _runner->runFrontend(pkgs, admission,
+											 tuned ? _profile->environment(pkgs, BuildProfile::registerBuild()) : QProcessEnvironment::systemEnvironment());
+	recordBuildTime(pkgs, timer.elapsed());
+	if(tuned) {
+		_profile->finish(pkgs);
+		BuildProfile::unregisterBuild();
+	}
+	return result;
+}
+
+void RebuildSession::buildBatch(const QStringList &pkgs, SourcePrefetcher *prefetcher, const QString &pkgDest)
+{
+	// build every pkgbase once, and only install the outputs that are pending
+	const auto pkgSet = QSet<QString>::fromList(pkgs);
+	const auto pkgBases = _resolver->readPkgBases(pkgs);
+	QStringList files;
+	QStringList built;
+	const auto groups = PkgResolver::groupByBase(pkgs, pkgBases);
+	const auto admission = _admission->isEnabled() ? _admission : nullptr;
+	const auto tuned = BuildProfile::isEnabled();
+	const auto chrooted = !ChrootBuilder::directory().isEmpty();
+	for(auto it = groups.constBegin(); it != groups.constEnd(); it++) {
+		if(admission)
+			admission->admit(*it);
+		upgradeSources(it.key(), *it, prefetcher);
+		const auto env = tuned ? _profile->environment(*it, BuildProfile::registerBuild()) : QProcessEnvironment::systemEnvironment();
+		QElapsedTimer timer;
+		timer.start();
+		const auto builtFiles = chrooted ?
+									_chroot->build(prefetcher->repositoryDir(it.key()), pkgDest, *it, admission, env) :
+									_runner->buildPackages(prefetcher->repositoryDir(it.key()), pkgDest, *it, admission, env);
+		recordBuildTime(*it, timer.elapsed());
+		if(tuned) {
+			_profile->finish(*it);
+			BuildProfile::unregisterBuild();
+		}
+		QStringList groupFiles;
+		for(const auto &file : builtFiles) {
+			// files are named <name>-<pkgver>-<pkgrel>-<arch>.pkg.tar.*
+			const auto nameParts = QFileInfo{file}.fileName().split(QLatin1Char('-'));
+			const auto name = nameParts.mid(0, nameParts.size() - 3).join(QLatin1Char('-'));
+			if(pkgSet.contains(name))
+				groupFiles.append(file);
+		}
+		if(groupFiles.size() < it->size()) {
+			for(const auto &pkg : *it) {
+				qWarning() << "Failed to rebuild" << pkg;
+				_failed.insert(pkg);
+			}
+		} else {
+			files.append(groupFiles);
+			built.append(*it);
+		}
+	}
+	if(files.isEmpty())
+		return;
+
+	// a single transaction, so the hook marks all of them as rebuilt at once
+	if(_runner->installPackages(files)) {
+		for(const auto &pkg : qAsConst(built))
+			markDone(pkg);
+	} else {
+		for(const auto &pkg : qAsConst(built)) {
+			qWarning() << "Failed to install the rebuilt package" << pkg;
+			_failed.insert(pkg);
+		}
+	}
+}
+
+void RebuildSession::cutOff(const QHash<QString, QByteArray> &fingerprints, const PkgResolver::PkgInfos &pkgInfos)
+{
+	for(auto it = fingerprints.constBegin(); it != fingerprints.constEnd(); it++) {
+		if(_done.contains(it.key()) &&
+		   !it.value().isEmpty() &&
+		   _runner->readFileFingerprint(it.key()) == it.value()) {
+			qInfo() << "Rebuilding" << it.key() << "did not change any of it's files";
+			_unchanged.insert(it.key());
+		}
+	}
+	if(_unchanged.isEmpty())
+		return;
+
+	// drop everything that was only marked because of unchanged packages, and then everything marked only by those
+	QStringList dropped;
+	auto changed = true;
+	while(changed) {
+		changed = false;
+		for(auto it = pkgInfos.constBegin(); it != pkgInfos.constEnd(); it++) {
+			if(_done.contains(it.key()) || _failed.contains(it.key()) || _skipped.contains(it.key()) ||
+			   it.value().isEmpty() || !_unchanged.contains(it.value()))
+				continue;
+			qInfo() << "Skipping" << it.key() << "because all packages that triggered it's rebuild are unchanged";
+			markDone(it.key());
+			_unchanged.insert(it.key());
+			dropped.append(it.key());
+			changed = true;
+		}
+	}
+	if(!dropped.isEmpty())
+		dropPending(dropped);
+}
+
+void RebuildSession::dropPending(const QStringList &pkgs)
+{
+	// only root may change the pending packages
+	if(global::isRoot())
+		_resolver->clear(pkgs);
+	else {
+		const auto sudo = QStandardPaths::findExecutable(QStringLiteral("sudo"));
+		if(sudo.isNull())
+			throw QStringLiteral("Unable to find sudo binary in PATH");
+		if(QProcess::execute(sudo, QStringList{QCoreApplication::applicationFilePath(), QStringLiteral("clear")} + pkgs) != EXIT_SUCCESS)
+			qWarning() << "Failed to clear the skipped packages, run `sudo repkg clear` for them manually";
+	}
+	_resolver->reload();
+}
+
+void RebuildSession::upgradeSources(const QString &pkgBase, const QStringList &pkgs, SourcePrefetcher *prefetcher)
+{
+	QString version;
+	for(const auto &pkg : pkgs) {
+		version = _upgrades.value(pkg);
+		if(!version.isNull())
+			break;
+	}
+	if(version.isNull() || pkgdb::vercmp(version, prefetcher->checkoutVersion(pkgBase)) <= 0)
+		return;
+
+	// the prefetch might have failed, or the repository was mirrored before the update was published
+	qDebug() << "Updating the build repository of" << pkgBase << "to" << version;
+	if(!prefetcher->prefetch(pkgBase) || pkgdb::vercmp(version, prefetcher->checkoutVersion(pkgBase)) > 0) {
+		qWarning().noquote() << "The build repository of" << pkgBase << "does not contain the upstream update to"
+							 << version << "- rebuilding the checked out version instead";
+	}
+}
+
+QStringList RebuildSession::substitute(const QStringList &pkgs, const PkgResolver::PkgInfos &pkgInfos, const QSet<QString> &open)
+{
+	if(_runner->substituteRepositories().isEmpty())
+		return pkgs;
+
+	// a binary can only replace the build if none of the packages it was built against is still to be rebuilt
+	PkgResolver::PkgInfos candidates;
+	for(const auto &pkg : pkgs) {
+		const auto triggers = pkgInfos.value(pkg);
+		// prebuilt packages would be replaced by the upstream update right away
+		if(!triggers.intersects(open) && !_upgrades.contains(pkg))
+			candidates.insert(pkg, triggers);
+	}
+	const auto substitutes = _runner->findSubstitutes(candidates);
+	if(substitutes.isEmpty())
+		return pkgs;
+
+	QStringList files;
+	for(const auto &pkg : pkgs) {
+		if(substitutes.contains(pkg))
+			files.append(substitutes.value(pkg));
+	}
+	if(!_runner->installPackages(files)) {
+		qWarning() << "Failed to install the prebuilt packages, building them from source instead";
+		return pkgs;
+	}
+
+	QStringList remaining;
+	for(const auto &pkg : pkgs) {
+		if(substitutes.contains(pkg)) {
+			qInfo() << "Installed prebuilt package for" << pkg;
+			markDone(pkg);
+		} else
+			remaining.append(pkg);
+	}
+	checkpoint();
+	return remaining;
+}
+
+QHash<QString, qint64> RebuildSession::readRuleCosts()
+{
+	QHash<QString, qint64> costs;
+	QSettings stats{statsFile(), QSettings::IniFormat};
+	stats.beginGroup(QStringLiteral("rulecost"));
+	for(const auto &origin : stats.childKeys())
+		costs.insert(origin, stats.value(origin).toLongLong());
+	stats.endGroup();
+	return costs;
+}
+
+void RebuildSession::recordBuildTime(const QStringList &pkgs, qint64 msecs)
+{
+	// packages built by one call share the time, which is then split among the rules that caused each rebuild
+	if(pkgs.isEmpty())
+		return;
+	const auto pkgTime = msecs / pkgs.size();
+	QSettings stats{statsFile(), QSettings::IniFormat};
+	stats.beginGroup(QStringLiteral("rulecost"));
+	for(const auto &pkg : pkgs) {
+		const auto origins = _resolver->findRuleOrigins(pkg, _pkgInfos.value(pkg));
+		for(const auto &origin : origins)
+			stats.setValue(origin, stats.value(origin, 0).toLongLong() + pkgTime / origins.size());
+	}
+	stats.endGroup();
+}
+
+QString RebuildSession::statsFile()
+{
+	return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QStringLiteral("/buildstats.conf");
+}
+
+void RebuildSession::markDone(const QString &pkg)
+{
+	_done.insert(pkg);
+	_failed.remove(pkg);
+	_skipped.remove(pkg);
+}
+
+void RebuildSession::checkpoint()
+{
+	_journal->setValue(QStringLiteral("session/done"), static_cast<QStringList>(_done.toList()));
+	_journal->setValue(QStringLiteral("session/failed"), static_cast<QStringList>(_failed.toList()));
+	_journal->setValue(QStringLiteral("session/skipped"), static_cast<QStringList>(_skipped.toList()));
+	_journal->sync();
+}
+
+QSet<QString> RebuildSession::readJournal(const QString &key) const
+{
+	return QSet<QString>::fromList(_journal->value(QStringLiteral("session/") + key).toStringList());
+}
@@ -0,0 +1,61 @@
+#ifndef REBUILDSESSION_H
+#define REBUILDSESSION_H
+
+#include "pacmanrunner.h"
+#include "pkgresolver.h"
+#include "admissioncontrol.h"
+#include "buildprofile.h"
+#include "upstreamsource.h"
+#include "chrootbuilder.h"
+
+#include <QObject>
+#include <QSet>
+#include <QSettings>
+
+class SourcePrefetcher;
+
+class RebuildSession : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit RebuildSession(PacmanRunner *runner, PkgResolver *resolver, QObject *parent = nullptr);
+
+	int run(const QList<QStringList> &waves, bool earlyCutoff = false);
+	int resume();
+
+	static QHash<QString, qint64> readRuleCosts(); // rule origin -> build time in ms
+
+private:
+	PacmanRunner *_runner;
+	PkgResolver *_resolver;
+	QSettings *_journal;
+	AdmissionControl *_admission;
+	BuildProfile *_profile;
+	UpstreamSource *_upstream;
+	ChrootBuilder *_chroot;
+
+	QSet<QString> _done;
+	QSet<QString> _failed;
+	QSet<QString> _skipped;
+	bool _earlyCutoff = false;
+	QSet<QString> _unchanged;
+	QHash<QString, QString> _upgrades;
+	PkgResolver::PkgInfos _pkgInfos;
+
+	int runWaves(const QList<QStringList> &waves);
+	int runFrontend(const QStringList &pkgs);
+	void buildBatch(const QStringList &pkgs, SourcePrefetcher *prefetcher, const QString &pkgDest);
+	void upgradeSources(const QString &pkgBase, const QStringList &pkgs, SourcePrefetcher *prefetcher);
+	void cutOff(const QHash<QString, QByteArray> &fingerprints, const PkgResolver::PkgInfos &pkgInfos);
+	void dropPending(const QStringList &pkgs);
+	QStringList substitute(const QStringList &pkgs, const PkgResolver::PkgInfos &pkgInfos, const QSet<QString> &open);
+	void recordBuildTime(const QStringList &pkgs, qint64 msecs);
+	void markDone(const QString &pkg);
+	void checkpoint();
+	QSet<QString> readJournal(const QString &key) const;
+
+	static QString statsFile();
+};
+
+#endif // REBUILDSESSION_H
@@ -1,9 +1,9 @@
 TEMPLATE = app
 
-QT += core
+QT += core concurrent network
 QT -= gui
 
-CONFIG += c++17 console warning_clean exceptions
+CONFIG += c++17 console warning_clean exceptions link_pkgconfig
 CONFIG -= app_bundle
 
 TARGET = repkg
@@ -23,11 +23,25 @@ DEFINES += "BUNDLE=\"\\\"$$QMAKE_TARGET_BUNDLE_PREFIX\\\"\""
 
 DEFINES += QT_DEPRECATED_WARNINGS QT_ASCII_CAST_WARNINGS
 
+PKGCONFIG += libarchive libalpm
+
 HEADERS += \
 	clicontroller.h \
 	rulecontroller.h \
 	pkgresolver.h \
 	pacmanrunner.h \
+	completioncache.h \
+	rootpool.h \
+	buildfarm.h \
+	pkgdb.h \
+	transactionlog.h \
+	pacmanlog.h \
+	sourceprefetcher.h \
+	rebuildsession.h \
+	admissioncontrol.h \
+	buildprofile.h \
+	upstreamsource.h \
+	chrootbuilder.h \
 	global.h
 
 SOURCES += main.cpp \
@@ -35,12 +49,26 @@ SOURCES += main.cpp \
 	rulecontroller.cpp \
 	pkgresolver.cpp \
 	pacmanrunner.cpp \
+	completioncache.cpp \
+	rootpool.cpp \
+	buildfarm.cpp \
+	pkgdb.cpp \
+	transactionlog.cpp \
+	pacmanlog.cpp \
+	sourceprefetcher.cpp \
+	rebuildsession.cpp \
+	admissioncontrol.cpp \
+	buildprofile.cpp \
+	upstreamsource.cpp \
+	chrootbuilder.cpp \
 	global.cpp
 
 DISTFILES += \
 	README.md \
 	repkg.sh \
 	repkg.hook \
+	farmtest.sh \
+	upstreamtest.sh \
 	completitions/bash/repkg \
 	completitions/zsh/_repkg
 
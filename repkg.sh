@@ -3,7 +3,7 @@ set -e
 
 /usr/bin/repkg update --stdin
 
-updatePkg=$(/usr/bin/repkg list)
+updatePkg=$(/usr/bin/repkg list --cached)
 if [ -n "$updatePkg" ]; then
 	echo -e "\e[36m>>>\e[0m \e[33mSome packages need to be rebuilt. See list below:\e[0m "
 	echo -e "\e[36m>>>\e[0m $updatePkg"
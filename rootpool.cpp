@@ -0,0 +1,57 @@
+#include "rootpool.h"
+
+#include <QDebug>
+#include <QFuture>
+#include <QtConcurrent>
+
+RootPool::RootPool(QList<global::RootConfig> roots, QObject *parent) :
+	QObject{parent},
+	_roots{std::move(roots)}
+{}
+
+QList<RootPool::Result> RootPool::run(const Task &task) const
+{
+	// first: parse each distinct set of rule directories only once
+	QHash<QString, QFuture<std::shared_ptr<const RuleController::RuleSet>>> ruleFutures;
+	for(const auto &root : _roots) {
+		const auto key = root.rulesKey();
+		if(ruleFutures.contains(key))
+			continue;
+		const auto paths = root.rulePaths;
+		ruleFutures.insert(key, QtConcurrent::run([paths]() {
+			return RuleController::parseRules(paths);
+		}));
+	}
+	qDebug() << "Parsing" << ruleFutures.size() << "distinct rule sets for" << _roots.size() << "roots";
+
+	QHash<QString, std::shared_ptr<const RuleController::RuleSet>> ruleSets;
+	for(auto it = ruleFutures.begin(); it != ruleFutures.end(); it++)
+		ruleSets.insert(it.key(), it->result());
+
+	// second: evaluate every root on the pool, each with it's own runner, controller and state
+	QList<QFuture<Result>> futures;
+	futures.reserve(_roots.size());
+	for(const auto &root : _roots) {
+		const auto ruleSet = ruleSets.value(root.rulesKey());
+		futures.append(QtConcurrent::run([root, ruleSet, task]() {
+			Result result;
+			result.name = root.name;
+			try {
+				PacmanRunner runner{root};
+				RuleController controller{root, &runner};
+				controller.setRuleSet(ruleSet);
+				PkgResolver resolver{root, &runner, &controller};
+				result.output = task(&runner, &controller, &resolver);
+			} catch(QString &e) {
+				result.error = e;
+			}
+			return result;
+		}));
+	}
+
+	QList<Result> results;
+	results.reserve(futures.size());
+	for(auto &future : futures)
+		results.append(future.result());
+	return results;
+}
@@ -0,0 +1,32 @@
+#ifndef ROOTPOOL_H
+#define ROOTPOOL_H
+
+#include "global.h"
+#include "pacmanrunner.h"
+#include "rulecontroller.h"
+#include "pkgresolver.h"
+
+#include <functional>
+#include <QObject>
+
+class RootPool : public QObject
+{
+	Q_OBJECT
+
+public:
+	struct Result {
+		QString name;
+		QString output;
+		QString error;
+	};
+	using Task = std::function<QString(PacmanRunner *, RuleController *, PkgResolver *)>;
+
+	explicit RootPool(QList<global::RootConfig> roots, QObject *parent = nullptr);
+
+	QList<Result> run(const Task &task) const;
+
+private:
+	QList<global::RootConfig> _roots;
+};
+
+#endif // ROOTPOOL_H
@@ -7,11 +7,21 @@
 #include <QTextStream>
 #include <QRegularExpression>
 #include <QDebug>
+#include <QMutex>
+#include <QtConcurrent>
 using namespace global;
 
+QMutex RuleController::_cacheMutex;
+QHash<QString, QVector<RuleController::RuleFile>> RuleController::_fileCache;
+
 RuleController::RuleController(PacmanRunner *runner, QObject *parent) :
+	RuleController{hostRoot(), runner, parent}
+{}
+
+RuleController::RuleController(const RootConfig &root, PacmanRunner *runner, QObject *parent) :
 	QObject{parent},
-	_runner{runner}
+	_runner{runner},
+	_paths{root.rulePaths}
 {}
 
 void RuleController::createRule(const QString &pkg, bool autoDepends, QStringList deps)
@@ -33,6 +43,7 @@ void RuleController::createRule(const QString &pkg, bool autoDepends, QStringLis
 
 	ruleFile.write(deps.join(QStringLiteral(" ")).toUtf8());
 	ruleFile.close();
+	clearCache();
 	qDebug() << "Created rule for" << qUtf8Printable(pkg) << "as:" << ruleFile.fileName();
 }
 
@@ -49,23 +60,17 @@ void RuleController::removeRule(const QString &pkg)
 		qWarning() << "Rule for" << qUtf8Printable(pkg) << "does not exist";
 	else if(!ruleFile.remove())
 		throw QStringLiteral("Failed to remove rule file for %1").arg(pkg);
+	clearCache();
 }
 
 QString RuleController::listRules(bool pkgOnly, bool userOnly)
 {
-	if(_rules.isEmpty())
-		readRules();
+	if(pkgOnly)
+		return listRuleNames(userOnly).join(QLatin1Char(' '));
+	else {
+		if(_rules.isEmpty())
+			readRules();
 
-	if(pkgOnly) {
-		QStringList pkgs;
-		pkgs.reserve(_ruleSources.size());
-		for(auto it = _ruleSources.constBegin(); it != _ruleSources.constEnd(); it++) {
-			if(userOnly && (it->isRoot != isRoot()))
-				continue;
-			pkgs.append(it.key());
-		}
-		return pkgs.join(QLatin1Char(' '));
-	} else {
 		auto baselen = 9;
 		for(auto it = _ruleSources.constBegin(); it != _ruleSources.constEnd(); it++)
 			baselen = std::max(baselen, it.key().size() + 2);
@@ -91,6 +96,21 @@ QString RuleController::listRules(bool pkgOnly, bool userOnly)
 	}
 }
 
+QStringList RuleController::listRuleNames(bool userOnly)
+{
+	if(_rules.isEmpty())
+		readRules();
+
+	QStringList pkgs;
+	pkgs.reserve(_ruleSources.size());
+	for(auto it = _ruleSources.constBegin(); it != _ruleSources.constEnd(); it++) {
+		if(userOnly && (it->isRoot != isRoot()))
+			continue;
+		pkgs.append(it.key());
+	}
+	return pkgs;
+}
+
 QList<RuleController::RuleInfo> RuleController::findRules(const QString &pkg)
 {
 	if(_rules.isEmpty())
@@ -98,72 +118,179 @@ QList<RuleController::RuleInfo> RuleController::findRules(const QString &pkg)
 	return _rules.values(pkg);
 }
 
-void RuleController::readRules()
+QHash<QString, int> RuleController::wildcardFanOut()
 {
-	QList<std::pair<QDir, bool>> paths {
-		{userPath(), false},
-		{rootPath(), true},
-		{systemPath(), true},
+	if(_rules.isEmpty())
+		readRules();
+	return _fanOut;
+}
+
+std::shared_ptr<const RuleController::RuleSet> RuleController::parseRules(QList<std::pair<QDir, bool>> paths)
+{
+	// directories shared by many rule sets (like the system rules for every user) are only read once per process
+	auto &cache = _fileCache;
+	const auto cacheKey = [](const std::pair<QDir, bool> &path) {
+		return QStringLiteral("%1:%2").arg(path.first.absolutePath()).arg(path.second);
 	};
 
-	_ruleSources.clear();
-	_rules.clear();
-	QHash<QString, std::pair<QList<RuleInfo>, bool>> ruleBase;  // (rules, extension)
-	QHash<QString, std::tuple<QRegularExpression, QList<RuleInfo>, bool>> wildcardRules;  // (pattern, rules, extension)
-
-	for(auto &path : paths) {
-		auto &dir = path.first;
-		dir.setFilter(QDir::Files | QDir::NoDotAndDotDot | QDir::Readable);
-		dir.setNameFilters({QStringLiteral("*.rule")});
-		for(const auto &fileInfo : dir.entryInfoList()) {
-			RuleSource ruleSrc;
-			auto name = fileInfo.completeBaseName();
-			ruleSrc.isRoot = path.second;
-			// check for extension rules
-			if(name.startsWith(QLatin1Char('+'))) {
-				name = name.mid(1);
-				ruleSrc.extension = true;
+	// first: scan all new directories and read the rule files in parallel
+	QVector<std::pair<QDir, QFileInfoList>> scans;
+	QList<bool> scanRoots;
+	{
+		QMutexLocker locker{&_cacheMutex};
+		for(const auto &path : paths) {
+			if(!cache.contains(cacheKey(path))) {
+				scans.append(std::make_pair(path.first, QFileInfoList{}));
+				scanRoots.append(path.second);
 			}
+		}
+	}
+	QtConcurrent::blockingMap(scans, [](std::pair<QDir, QFileInfoList> &scan) {
+		scan.first.setFilter(QDir::Files | QDir::NoDotAndDotDot | QDir::Readable);
+		scan.first.setNameFilters({QStringLiteral("*.rule")});
+		scan.second = scan.first.entryInfoList();
+	});
 
-			// special handling for wildcard rules
-			if(name.contains(QLatin1Char('*')) ||
-			   name.contains(QLatin1Char('?')) ||
-			   (name.contains(QLatin1Char('[')) && name.contains(QLatin1Char(']')))) {
-				auto definitions = readRuleDefinitions(fileInfo, ruleSrc);
-				if(wildcardRules.contains(name)) {
-					auto &entry = wildcardRules[name];
-					if(std::get<2>(entry)) {
-						addRules(std::get<1>(entry), definitions);
-						std::get<2>(entry) = ruleSrc.extension;
-					}
-				} else {
-					QRegularExpression ruleRegex {
-						QRegularExpression::wildcardToRegularExpression(name),
-						QRegularExpression::DontCaptureOption
-					};
-					wildcardRules.insert(name, std::make_tuple(std::move(ruleRegex), std::move(definitions), ruleSrc.extension));
+	QVector<RuleFile> newFiles;
+	QVector<std::pair<QString, int>> newDirs; // (cache key, number of files)
+	for(auto i = 0; i < scans.size(); i++) {
+		for(const auto &fileInfo : qAsConst(scans[i].second)) {
+			RuleFile ruleFile;
+			ruleFile.fileInfo = fileInfo;
+			ruleFile.source.isRoot = scanRoots[i];
+			newFiles.append(ruleFile);
+		}
+		newDirs.append(std::make_pair(cacheKey(std::make_pair(scans[i].first, scanRoots[i])), scans[i].second.size()));
+	}
+	QtConcurrent::blockingMap(newFiles, &RuleController::readRuleFile);
+
+	QVector<RuleFile> ruleFiles;
+	{
+		QMutexLocker locker{&_cacheMutex};
+		auto offset = 0;
+		for(const auto &dir : qAsConst(newDirs)) {
+			cache.insert(dir.first, newFiles.mid(offset, dir.second));
+			offset += dir.second;
+		}
+		for(const auto &path : paths)
+			ruleFiles.append(cache.value(cacheKey(path)));
+	}
+
+	// second: merge the results in the order the files were found, to keep the precedence deterministic
+	auto ruleSet = std::make_shared<RuleSet>();
+	auto &ruleBase = ruleSet->rules;
+	auto &wildcardRules = ruleSet->wildcards;
+	for(auto &ruleFile : ruleFiles) {
+		const auto &name = ruleFile.name;
+		if(ruleFile.wildcard) {
+			if(wildcardRules.contains(name)) {
+				auto &entry = wildcardRules[name];
+				if(std::get<2>(entry)) {
+					addRules(std::get<1>(entry), ruleFile.rules);
+					std::get<2>(entry) = ruleFile.source.extension;
 				}
-			} else { // normal rules are treated normall
-				// skip already handeled rules
-				if(ruleBase.contains(name))
-					continue;
-				// read rule definitions and add to mapping and rule list
-				ruleBase.insert(name, {readRuleDefinitions(fileInfo, ruleSrc), ruleSrc.extension});
+			} else {
+				QRegularExpression ruleRegex {
+					QRegularExpression::wildcardToRegularExpression(name),
+					QRegularExpression::DontCaptureOption
+				};
+				wildcardRules.insert(name, std::make_tuple(std::move(ruleRegex), std::move(ruleFile.rules), ruleFile.source.extension));
 			}
-			_ruleSources.insert(name, ruleSrc);
+		} else { // normal rules are treated normall
+			// skip already handeled rules
+			if(ruleBase.contains(name))
+				continue;
+			// add the rule definitions to mapping and rule list
+			ruleBase.insert(name, {std::move(ruleFile.rules), ruleFile.source.extension});
 		}
+		ruleSet->sources.insert(name, ruleFile.source);
+	}
+
+	return ruleSet;
+}
+
+void RuleController::setRuleSet(std::shared_ptr<const RuleSet> ruleSet)
+{
+	_ruleSet = std::move(ruleSet);
+	_ruleSources.clear();
+	_rules.clear();
+	_fanOut.clear();
+}
+
+void RuleController::setOwners(const QMap<QString, QList<std::pair<QDir, bool>>> &ownerPaths)
+{
+	_ownerPaths = ownerPaths;
+	setRuleSet({});
+}
+
+void RuleController::clearCache()
+{
+	{
+		QMutexLocker locker{&_cacheMutex};
+		_fileCache.clear();
 	}
+	setRuleSet({});
+}
+
+void RuleController::readRules()
+{
+	_ruleSources.clear();
+	_rules.clear();
+	_fanOut.clear();
+	std::optional<QStringList> foreignPkgs;
+	QHash<QString, QHash<QString, bool>> wildcardMatches;
+
+	// the parsed rule files only depend on the directories, and can thus be shared between roots
+	if(_ownerPaths.isEmpty()) {
+		if(!_ruleSet)
+			_ruleSet = parseRules(_paths);
+		addRuleSet(*_ruleSet, std::nullopt, foreignPkgs, wildcardMatches);
+	} else {
+		// every owner has it's own precedence, but identical rules are only evaluated once for all of them
+		for(auto it = _ownerPaths.constBegin(); it != _ownerPaths.constEnd(); it++)
+			addRuleSet(*parseRules(*it), it.key(), foreignPkgs, wildcardMatches);
+	}
+}
+
+void RuleController::addRuleSet(const RuleSet &ruleSet, const std::optional<QString> &owner,
+								std::optional<QStringList> &foreignPkgs, QHash<QString, QHash<QString, bool>> &wildcardMatches)
+{
+	for(auto it = ruleSet.sources.constBegin(); it != ruleSet.sources.constEnd(); it++) {
+		if(!_ruleSources.contains(it.key()))
+			_ruleSources.insert(it.key(), *it);
+	}
+
+	auto ruleBase = ruleSet.rules;
+	const auto &wildcardRules = ruleSet.wildcards;
+	QHash<QString, int> fanOut;
+	for(auto wIt = wildcardRules.constBegin(); wIt != wildcardRules.constEnd(); wIt++)
+		fanOut.insert(wIt.key(), 0);
+	// the same wildcard is shared by many owners, so each package is only matched once
+	const auto matches = [&](decltype(wildcardRules.constBegin()) wIt, const QString &pkg) {
+		auto &wildcardMatch = wildcardMatches[wIt.key()];
+		auto match = wildcardMatch.constFind(pkg);
+		if(match == wildcardMatch.constEnd())
+			match = wildcardMatch.insert(pkg, std::get<0>(*wIt).match(pkg).hasMatch());
+		return *match;
+	};
 
 	// find ALL foreign packages and match them against the wildcards to add them if neccessary
 	if(!wildcardRules.isEmpty()) {
-		for(const auto &pkg : _runner->readForeignPackages()) {
+		if(!foreignPkgs)
+			foreignPkgs = _runner->readForeignPackages();
+		for(const auto &pkg : qAsConst(*foreignPkgs)) {
 			// skip already existing rules
 			if(ruleBase.contains(pkg))
 				continue;
-			// match againts wildcards
-			for(const auto &wTpl : qAsConst(wildcardRules)) {
-				if(std::get<0>(wTpl).match(pkg).hasMatch())
-					ruleBase.insert(pkg, {std::get<1>(wTpl), std::get<2>(wTpl)});
+			// match againts wildcards - only the last matching one is applied, so only that one counts
+			auto applied = wildcardRules.constEnd();
+			for(auto wIt = wildcardRules.constBegin(); wIt != wildcardRules.constEnd(); wIt++) {
+				if(matches(wIt, pkg))
+					applied = wIt;
+			}
+			if(applied != wildcardRules.constEnd()) {
+				ruleBase.insert(pkg, {std::get<1>(*applied), std::get<2>(*applied)});
+				fanOut[applied.key()]++;
 			}
 		}
 	}
@@ -171,9 +298,11 @@ void RuleController::readRules()
 	for(auto it = ruleBase.begin(); it != ruleBase.end(); it++) {
 		// add regex rules to extensible normal rules
 		if(it->second) {
-			for(const auto &wTpl : qAsConst(wildcardRules)) {
-				if(std::get<0>(wTpl).match(it.key()).hasMatch())
-					addRules(it->first, std::get<1>(wTpl));
+			for(auto wIt = wildcardRules.constBegin(); wIt != wildcardRules.constEnd(); wIt++) {
+				if(matches(wIt, it.key())) {
+					addRules(it->first, std::get<1>(*wIt));
+					fanOut[wIt.key()]++;
+				}
 			}
 		}
 
@@ -181,9 +310,50 @@ void RuleController::readRules()
 		for(auto &rule : it->first) {
 			auto name = it.key();
 			std::swap(name, rule.package);
+			if(owner) {
+				auto existing = _rules.find(name);
+				while(existing != _rules.end() && existing.key() == name && !isSameRule(*existing, rule))
+					existing++;
+				if(existing != _rules.end() && existing.key() == name) {
+					existing->owners.insert(*owner);
+					continue;
+				}
+				rule.owners = {*owner};
+			}
 			_rules.insert(name, rule);
 		}
 	}
+
+	for(auto it = fanOut.constBegin(); it != fanOut.constEnd(); it++)
+		_fanOut[it.key()] = std::max(_fanOut.value(it.key()), *it);
+}
+
+bool RuleController::isSameRule(const RuleInfo &lhs, const RuleInfo &rhs)
+{
+	return lhs.package == rhs.package &&
+			lhs.origin == rhs.origin &&
+			lhs.scope == rhs.scope &&
+			lhs.range == rhs.range &&
+			lhs.count == rhs.count;
+}
+
+void RuleController::readRuleFile(RuleFile &ruleFile)
+{
+	ruleFile.name = ruleFile.fileInfo.completeBaseName();
+	// check for extension rules
+	if(ruleFile.name.startsWith(QLatin1Char('+'))) {
+		ruleFile.name = ruleFile.name.mid(1);
+		ruleFile.source.extension = true;
+	}
+
+	// special handling for wildcard rules
+	const auto &name = ruleFile.name;
+	ruleFile.wildcard = name.contains(QLatin1Char('*')) ||
+						name.contains(QLatin1Char('?')) ||
+						(name.contains(QLatin1Char('[')) && name.contains(QLatin1Char(']')));
+	ruleFile.rules = readRuleDefinitions(ruleFile.fileInfo, ruleFile.source);
+	for(auto &rule : ruleFile.rules)
+		rule.origin = name;
 }
 
 QList<RuleController::RuleInfo> RuleController::readRuleDefinitions(const QFileInfo &fileInfo, RuleSource &srcBase)
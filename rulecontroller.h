@@ -5,11 +5,17 @@
 #include <QHash>
 #include <QDir>
 #include <QMap>
+#include <QSet>
 #include <QFileInfo>
+#include <QMutex>
+#include <QVector>
+#include <QRegularExpression>
 #include <variant>
 #include <optional>
+#include <memory>
 
 #include "pacmanrunner.h"
+#include "global.h"
 
 class RuleController : public QObject
 {
@@ -30,9 +36,11 @@ public:
 		using Range = std::optional<RangeContent>; // (offset, limit)
 
 		QString package;
+		QString origin; // the rule file (package or wildcard) the rule was defined in
 		RuleScope scope = RuleScope::Any;
 		Range range;
 		std::optional<int> count;
+		QSet<QString> owners; // the users the rule belongs to, empty if it is not tagged
 	};
 
 	struct RuleSource {
@@ -41,22 +49,55 @@ public:
 		QStringList targets;
 	};
 
+	struct RuleSet {
+		QMap<QString, RuleSource> sources;
+		QHash<QString, std::pair<QList<RuleInfo>, bool>> rules;  // (rules, extension)
+		QHash<QString, std::tuple<QRegularExpression, QList<RuleInfo>, bool>> wildcards;  // (pattern, rules, extension)
+	};
+
 	explicit RuleController(PacmanRunner *runner, QObject *parent = nullptr);
+	explicit RuleController(const global::RootConfig &root, PacmanRunner *runner, QObject *parent = nullptr);
+
+	static std::shared_ptr<const RuleSet> parseRules(QList<std::pair<QDir, bool>> paths);
+	void setRuleSet(std::shared_ptr<const RuleSet> ruleSet);
+	void setOwners(const QMap<QString, QList<std::pair<QDir, bool>>> &ownerPaths); // owner -> rule paths, merged into one tagged index
 
 	void createRule(const QString &pkg, bool autoDepends, QStringList deps);
 	void removeRule(const QString &pkg);
 
 	QString listRules(bool pkgOnly, bool userOnly);
+	QStringList listRuleNames(bool userOnly);
 
 	QList<RuleInfo> findRules(const QString &pkg);
+	QHash<QString, int> wildcardFanOut(); // wildcard -> number of packages it applies to
 
 private:
+	struct RuleFile {
+		QFileInfo fileInfo;
+		QString name;
+		bool wildcard = false;
+		RuleSource source;
+		QList<RuleInfo> rules;
+	};
+
 	PacmanRunner *_runner;
+	QList<std::pair<QDir, bool>> _paths;
+	QMap<QString, QList<std::pair<QDir, bool>>> _ownerPaths;
+	std::shared_ptr<const RuleSet> _ruleSet;
 	QMap<QString, RuleSource> _ruleSources;
 	QMultiHash<QString, RuleInfo> _rules;
+	QHash<QString, int> _fanOut;
+
+	static QMutex _cacheMutex;
+	static QHash<QString, QVector<RuleFile>> _fileCache; // "<path>:<isRoot>" -> rule files
 
+	void clearCache();
 	void readRules();
-	QList<RuleInfo> readRuleDefinitions(const QFileInfo &fileInfo, RuleSource &srcBase);
+	void addRuleSet(const RuleSet &ruleSet, const std::optional<QString> &owner,
+					std::optional<QStringList> &foreignPkgs, QHash<QString, QHash<QString, bool>> &wildcardMatches);
+	static bool isSameRule(const RuleInfo &lhs, const RuleInfo &rhs);
+	static void readRuleFile(RuleFile &ruleFile);
+	static QList<RuleInfo> readRuleDefinitions(const QFileInfo &fileInfo, RuleSource &srcBase);
 	static void parseScope(RuleInfo &ruleInfo, const QStringRef &scopeStr);
 	static void addRules(QList<RuleInfo> &target, const QList<RuleInfo> &newRules);
 };
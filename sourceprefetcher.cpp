@@ -0,0 +1,146 @@
+#include "sourceprefetcher.h"
+
+#include <QDebug>
+#include <QProcess>
+#include <QStandardPaths>
+#include <QtConcurrent>
+
+SourcePrefetcher::SourcePrefetcher(QString remote, QObject *parent) :
+	QObject{parent},
+	_remote{std::move(remote)},
+	_cacheDir{QStandardPaths::writableLocation(QStandardPaths::CacheLocation)},
+	_pool{new QThreadPool{this}}
+{
+	// fetching is mostly IO bound, but keep the load on the remotes reasonable
+	_pool->setMaxThreadCount(4);
+	for(const auto &dir : {QStringLiteral("repos"), QStringLiteral("sources"), QStringLiteral("logs")}) {
+		if(!_cacheDir.mkpath(dir))
+			throw QStringLiteral("Failed to create prefetch cache directory %1").arg(_cacheDir.absoluteFilePath(dir));
+	}
+}
+
+SourcePrefetcher::~SourcePrefetcher()
+{
+	// the jobs access the members, so they must be done before those are destroyed
+	_pool->clear();
+	_pool->waitForDone();
+}
+
+QString SourcePrefetcher::sourceDir() const
+{
+	return _cacheDir.absoluteFilePath(QStringLiteral("sources"));
+}
+
+QString SourcePrefetcher::repositoryDir(const QString &pkgBase) const
+{
+	return _cacheDir.absoluteFilePath(QStringLiteral("repos/") + pkgBase);
+}
+
+void SourcePrefetcher::start(const QList<std::pair<QString, QString>> &pkgs)
+{
+	QHash<QString, QFuture<bool>> baseJobs;
+	for(const auto &pkg : pkgs) {
+		auto job = baseJobs.value(pkg.second);
+		if(!baseJobs.contains(pkg.second)) {
+			const auto pkgBase = pkg.second;
+			job = QtConcurrent::run(_pool, [this, pkgBase]() {
+				return prefetch(pkgBase);
+			});
+			baseJobs.insert(pkgBase, job);
+		}
+		_jobs.insert(pkg.first, job);
+	}
+	qDebug() << "Started prefetching sources of" << baseJobs.size() << "packages";
+}
+
+bool SourcePrefetcher::waitFor(const QStringList &pkgs)
+{
+	auto ok = true;
+	for(const auto &pkg : pkgs) {
+		if(!_jobs.contains(pkg))
+			continue;
+		auto job = _jobs.value(pkg);
+		if(!job.result()) {
+			qWarning() << "Failed to prefetch sources of" << pkg
+					   << "- the frontend will download them itself";
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool SourcePrefetcher::prefetch(const QString &pkgBase) const
+{
+	// first: mirror the build repository
+	const auto repoDir = repositoryDir(pkgBase);
+	auto ok = false;
+	if(QDir{repoDir}.exists(QStringLiteral(".git"))) {
+		ok = runTool(QStringLiteral("git"),
+					 {QStringLiteral("pull"), QStringLiteral("--ff-only"), QStringLiteral("--quiet")},
+					 repoDir, pkgBase);
+	} else {
+		ok = runTool(QStringLiteral("git"),
+					 {QStringLiteral("clone"), QStringLiteral("--quiet"), _remote.arg(pkgBase), repoDir},
+					 _cacheDir.absolutePath(), pkgBase);
+	}
+	if(!ok)
+		return false;
+
+	// second: download and verify the sources into the shared SRCDEST
+	return runTool(QStringLiteral("makepkg"),
+				   {QStringLiteral("--verifysource"), QStringLiteral("--noconfirm")},
+				   repoDir, pkgBase);
+}
+
+QString SourcePrefetcher::checkoutVersion(const QString &pkgBase) const
+{
+	QFile file{QDir{repositoryDir(pkgBase)}.absoluteFilePath(QStringLiteral(".SRCINFO"))};
+	if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+		return {};
+
+	// only the pkgbase section at the top defines the version
+	QString epoch, pkgver, pkgrel;
+	while(!file.atEnd()) {
+		const auto line = QString::fromUtf8(file.readLine()).trimmed();
+		if(line.startsWith(QStringLiteral("pkgname ")))
+			break;
+		const auto value = line.section(QLatin1Char('='), 1).trimmed();
+		if(line.startsWith(QStringLiteral("epoch ")))
+			epoch = value;
+		else if(line.startsWith(QStringLiteral("pkgver ")))
+			pkgver = value;
+		else if(line.startsWith(QStringLiteral("pkgrel ")))
+			pkgrel = value;
+	}
+	if(pkgver.isEmpty())
+		return {};
+	return QStringLiteral("%1%2-%3")
+			.arg(epoch.isEmpty() ? QString{} : epoch + QLatin1Char(':'), pkgver, pkgrel);
+}
+
+bool SourcePrefetcher::runTool(const QString &tool, const QStringList &args, const QString &workDir, const QString &pkgBase) const
+{
+	const auto bin = QStandardPaths::findExecutable(tool);
+	if(bin.isNull()) {
+		qWarning() << "Unable to find" << tool << "binary in PATH";
+		return false;
+	}
+
+	// keep the output away from the running build
+	const auto logFile = _cacheDir.absoluteFilePath(QStringLiteral("logs/%1.log").arg(pkgBase));
+	QProcess proc;
+	proc.setProgram(bin);
+	proc.setArguments(args);
+	proc.setWorkingDirectory(workDir);
+	proc.setStandardOutputFile(logFile, QIODevice::Append);
+	proc.setStandardErrorFile(logFile, QIODevice::Append);
+	auto env = QProcessEnvironment::systemEnvironment();
+	env.insert(QStringLiteral("SRCDEST"), sourceDir());
+	proc.setProcessEnvironment(env);
+
+	qDebug() << "Prefetching" << pkgBase << "via" << tool << args.first() << "...";
+	proc.start();
+	return proc.waitForFinished(-1) &&
+			proc.exitStatus() == QProcess::NormalExit &&
+			proc.exitCode() == EXIT_SUCCESS;
+}
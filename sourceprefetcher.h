@@ -0,0 +1,35 @@
+#ifndef SOURCEPREFETCHER_H
+#define SOURCEPREFETCHER_H
+
+#include <QObject>
+#include <QDir>
+#include <QFuture>
+#include <QHash>
+#include <QThreadPool>
+
+class SourcePrefetcher : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit SourcePrefetcher(QString remote, QObject *parent = nullptr);
+	~SourcePrefetcher() override;
+
+	QString sourceDir() const;
+	QString repositoryDir(const QString &pkgBase) const;
+
+	void start(const QList<std::pair<QString, QString>> &pkgs); // (package, pkgbase), in build order
+	bool waitFor(const QStringList &pkgs);
+	bool prefetch(const QString &pkgBase) const;
+	QString checkoutVersion(const QString &pkgBase) const; // [epoch:]pkgver-pkgrel of the mirrored build repository
+
+private:
+	QString _remote;
+	QDir _cacheDir;
+	QThreadPool *_pool;
+	QHash<QString, QFuture<bool>> _jobs; // package -> prefetch of it's pkgbase
+
+	bool runTool(const QString &tool, const QStringList &args, const QString &workDir, const QString &pkgBase) const;
+};
+
+#endif // SOURCEPREFETCHER_H
@@ -0,0 +1,82 @@
+#include "transactionlog.h"
+#include <QDataStream>
+#include <QFile>
+
+#include <unistd.h>
+
+namespace {
+
+// the file starts with the magic, followed by the records:
+// qint64 msecs since epoch, quint32 entry count, and name, old and new version as utf8 byte arrays per entry
+const QByteArray Magic = QByteArrayLiteral("RPKGTXL1");
+constexpr auto StreamVersion = QDataStream::Qt_5_6;
+// no transaction ever touches that many packages, so larger counts can only be corrupt data
+constexpr quint32 MaxEntries = 1u << 20;
+
+}
+
+void transactionlog::append(const QString &path, const Transaction &transaction, bool sync)
+{
+	QFile file{path};
+	if(!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+		throw QStringLiteral("Failed to open transaction log %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+	append(file, transaction, sync);
+}
+
+void transactionlog::append(QFile &file, const Transaction &transaction, bool sync)
+{
+	const auto path = file.fileName();
+	QDataStream stream{&file};
+	stream.setVersion(StreamVersion);
+	if(file.size() == 0)
+		stream.writeRawData(Magic.constData(), Magic.size());
+	stream << static_cast<qint64>(transaction.time.toMSecsSinceEpoch())
+		   << static_cast<quint32>(transaction.entries.size());
+	for(const auto &entry : transaction.entries)
+		stream << entry.name << entry.oldVersion << entry.newVersion;
+	if(stream.status() != QDataStream::Ok || !file.flush() || (sync && ::fsync(file.handle()) != 0)) {
+		throw QStringLiteral("Failed to write transaction log %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+}
+
+void transactionlog::read(const QString &path, const std::function<void(const Transaction&)> &handler)
+{
+	QFile file{path};
+	if(!file.open(QIODevice::ReadOnly)) {
+		throw QStringLiteral("Failed to open transaction log %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+
+	// logs are small compared to the memory, reading them at once is the fastest way
+	const auto data = file.readAll();
+	if(!data.startsWith(Magic))
+		throw QStringLiteral("%1 is not a repkg transaction log").arg(path);
+	QDataStream stream{data.mid(Magic.size())};
+	stream.setVersion(StreamVersion);
+
+	Transaction transaction;
+	while(!stream.atEnd()) {
+		qint64 time = 0;
+		quint32 count = 0;
+		stream >> time >> count;
+		if(count > MaxEntries)
+			stream.setStatus(QDataStream::ReadCorruptData);
+		if(stream.status() != QDataStream::Ok) {
+			qWarning("Ignoring corrupt record in transaction log %s", qUtf8Printable(path));
+			break;
+		}
+		transaction.time = QDateTime::fromMSecsSinceEpoch(time);
+		transaction.entries.resize(static_cast<int>(count));
+		for(auto &entry : transaction.entries)
+			stream >> entry.name >> entry.oldVersion >> entry.newVersion;
+		if(stream.status() != QDataStream::Ok) {
+			// a crash while appending can leave a partial record at the end
+			qWarning("Ignoring incomplete record at the end of transaction log %s", qUtf8Printable(path));
+			break;
+		}
+		handler(transaction);
+	}
+}
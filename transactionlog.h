@@ -0,0 +1,32 @@
+#ifndef TRANSACTIONLOG_H
+#define TRANSACTIONLOG_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QFile>
+#include <QVector>
+#include <functional>
+
+namespace transactionlog
+{
+
+struct Entry {
+	QByteArray name;
+	QByteArray oldVersion; // empty if unknown
+	QByteArray newVersion;
+};
+
+struct Transaction {
+	QDateTime time;
+	QVector<Entry> entries;
+};
+
+// appends the transaction to the log, creating it if needed
+// with sync, the data is on the disk once the function returns
+void append(const QString &path, const Transaction &transaction, bool sync = false);
+void append(QFile &file, const Transaction &transaction, bool sync = false);
+// passes all transactions of the log to the handler, oldest first
+void read(const QString &path, const std::function<void(const Transaction&)> &handler);
+}
+
+#endif // TRANSACTIONLOG_H
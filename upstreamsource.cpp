@@ -0,0 +1,121 @@
+#include "upstreamsource.h"
+#include "pkgdb.h"
+
+#include <QDebug>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QSettings>
+#include <QUrlQuery>
+
+namespace {
+
+// the AUR limits the length of request urls, so very large queries are split
+constexpr int MaxQueryPackages = 150;
+
+}
+
+UpstreamSource::UpstreamSource(PacmanRunner *runner, QObject *parent) :
+	QObject{parent},
+	_runner{runner}
+{}
+
+QString UpstreamSource::source()
+{
+	QSettings settings;
+	return settings.value(QStringLiteral("upstream/source")).toString();
+}
+
+void UpstreamSource::setSource(const QString &source)
+{
+	QSettings settings;
+	if(source.isEmpty()) {
+		settings.remove(QStringLiteral("upstream"));
+		qDebug() << "Disabled upstream update checks";
+	} else {
+		settings.setValue(QStringLiteral("upstream/source"), source);
+		qDebug() << "Checking for upstream updates via" << source;
+	}
+}
+
+QHash<QString, QString> UpstreamSource::readUpdates(const QStringList &pkgs) const
+{
+	QHash<QString, QString> updates;
+	const auto src = source();
+	if(src.isEmpty() || pkgs.isEmpty())
+		return updates;
+
+	// http(s) urls are queried as AUR RPC, everything else is a local snapshot of the same json
+	const QUrl url{src};
+	QJsonArray results;
+	if(url.scheme() == QStringLiteral("http") || url.scheme() == QStringLiteral("https")) {
+		for(auto i = 0; i < pkgs.size(); i += MaxQueryPackages) {
+			for(const auto &result : queryRpc(url, pkgs.mid(i, MaxQueryPackages)))
+				results.append(result);
+		}
+	} else
+		results = readSnapshot(url.isLocalFile() ? url.toLocalFile() : src);
+
+	const auto pkgSet = QSet<QString>::fromList(pkgs);
+	for(const auto &value : qAsConst(results)) {
+		const auto info = value.toObject();
+		const auto name = info.value(QStringLiteral("Name")).toString();
+		if(!pkgSet.contains(name))
+			continue;
+		const auto version = info.value(QStringLiteral("Version")).toString();
+		if(pkgdb::vercmp(version, _runner->readLocalVersion(name)) > 0)
+			updates.insert(name, version);
+	}
+	qDebug() << "Found" << updates.size() << "upstream updates for" << pkgs.size() << "packages";
+	return updates;
+}
+
+QJsonArray UpstreamSource::queryRpc(const QUrl &url, const QStringList &pkgs)
+{
+	auto queryUrl = url;
+	QUrlQuery query{url};
+	query.addQueryItem(QStringLiteral("v"), QStringLiteral("5"));
+	query.addQueryItem(QStringLiteral("type"), QStringLiteral("info"));
+	for(const auto &pkg : pkgs)
+		query.addQueryItem(QStringLiteral("arg[]"), pkg);
+	queryUrl.setQuery(query);
+
+	qDebug() << "Querying upstream versions of" << pkgs.size() << "packages...";
+	QNetworkAccessManager nam;
+	QEventLoop loop;
+	QScopedPointer<QNetworkReply> reply{nam.get(QNetworkRequest{queryUrl})};
+	QObject::connect(reply.data(), &QNetworkReply::finished,
+					 &loop, &QEventLoop::quit);
+	loop.exec();
+	if(reply->error() != QNetworkReply::NoError)
+		throw QStringLiteral("Failed to query upstream versions with error: %1").arg(reply->errorString());
+
+	const auto response = QJsonDocument::fromJson(reply->readAll()).object();
+	if(response.value(QStringLiteral("type")).toString() == QStringLiteral("error"))
+		throw QStringLiteral("Failed to query upstream versions with error: %1").arg(response.value(QStringLiteral("error")).toString());
+	return response.value(QStringLiteral("results")).toArray();
+}
+
+QJsonArray UpstreamSource::readSnapshot(const QString &path)
+{
+	QFile file{path};
+	if(!file.open(QIODevice::ReadOnly)) {
+		throw QStringLiteral("Failed to read upstream snapshot %1 with error: %2")
+				.arg(path, file.errorString());
+	}
+
+	// either a saved RPC response, or a plain array of package infos like the AUR metadata dumps
+	QJsonParseError error;
+	const auto doc = QJsonDocument::fromJson(file.readAll(), &error);
+	if(error.error != QJsonParseError::NoError) {
+		throw QStringLiteral("Failed to parse upstream snapshot %1 with error: %2")
+				.arg(path, error.errorString());
+	}
+	if(doc.isArray())
+		return doc.array();
+	else
+		return doc.object().value(QStringLiteral("results")).toArray();
+}
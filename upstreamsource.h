@@ -0,0 +1,30 @@
+#ifndef UPSTREAMSOURCE_H
+#define UPSTREAMSOURCE_H
+
+#include "pacmanrunner.h"
+
+#include <QHash>
+#include <QJsonArray>
+#include <QObject>
+#include <QUrl>
+
+class UpstreamSource : public QObject
+{
+	Q_OBJECT
+
+public:
+	explicit UpstreamSource(PacmanRunner *runner, QObject *parent = nullptr);
+
+	static QString source();
+	static void setSource(const QString &source);
+
+	QHash<QString, QString> readUpdates(const QStringList &pkgs) const; // package -> newer upstream version
+
+private:
+	PacmanRunner *_runner;
+
+	static QJsonArray queryRpc(const QUrl &url, const QStringList &pkgs);
+	static QJsonArray readSnapshot(const QString &path);
+};
+
+#endif // UPSTREAMSOURCE_H
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks upstream update detection against a local json snapshot instead of the AUR. Three
+# installed packages are looked up: one with a newer version in the snapshot, one with the
+# same version and one that is missing from the snapshot. Only the first one may be reported.
+# The configuration is written to a temporary directory, the real one is not touched.
+# Usage: upstreamtest.sh [<repkg binary>]
+set -e
+
+repkg=${1:-repkg}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+export XDG_CONFIG_HOME="$tmp/config"
+
+set -- $(pacman -Q | head -n 3)
+if [ $# -lt 6 ]; then
+	echo "At least 3 installed packages are needed" >&2
+	exit 1
+fi
+newer=$1
+newerVersion=$2
+equal=$3
+equalVersion=$4
+missing=$5
+
+# an epoch always makes a version newer than one without
+cat > "$tmp/snapshot.json" <<EOF
+{"resultcount":2,"results":[
+	{"Name":"$newer","Version":"99:$newerVersion"},
+	{"Name":"$equal","Version":"$equalVersion"}
+],"type":"multiinfo","version":5}
+EOF
+
+"$repkg" frontend --upstream "$tmp/snapshot.json"
+output=$("$repkg" upstream "$newer" "$equal" "$missing")
+
+result=0
+expected="$newer $newerVersion -> 99:$newerVersion"
+if [ "$output" = "$expected" ]; then
+	echo "ok:      $newer"
+	echo "ok:      $equal"
+	echo "ok:      $missing"
+else
+	echo "failed:  expected \"$expected\", got:"
+	echo "$output"
+	result=1
+fi
+exit $result